@@ -0,0 +1,189 @@
+#pragma once
+//
+// Switching between Hamming codes of different word sizes during a transfer.
+//
+// The client starts a block with rate marker, 'R' followed by the digit of the code index, to make
+// all next blocks encoded with that code. The server answers to the client which sent a marker with
+// feedback lines "feedback <bits> <single> <double> <many>\n", holding the number of received block bits
+// and detected errors since the previous feedback.
+//
+
+#include <bitset>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include <Poco/Exception.h>
+#include <Poco/Format.h>
+#include "hamming_code.h"
+#include "block_format.h"
+
+class RuntimeHammingCode {
+    /// Hamming code with word size chosen at runtime, working with blocks in text format.
+public:
+    virtual ~RuntimeHammingCode() = default;
+
+    virtual int getWordSize() const = 0;
+
+    virtual int getBlockSize() const = 0;
+
+    virtual void encode(const char* word, char* block) const = 0;
+        /// Encodes word given as '0' and '1' chars into block in text format.
+
+    virtual int decode(const char* block, std::string& decodedMessage) const = 0;
+        /// Decodes block in text format, appends chars of the word to decodedMessage
+        /// and returns detected errors count as HammingCode::decode does.
+};
+
+template <int wordSize>
+class RuntimeHammingCodeImpl: public RuntimeHammingCode {
+public:
+    int getWordSize() const override {
+        return wordSize;
+    }
+
+    int getBlockSize() const override {
+        return HammingCode<wordSize>::getBlockSize();
+    }
+
+    void encode(const char* word, char* block) const override {
+        std::bitset<wordSize> bits;
+        for (int i = 0; i < wordSize; i++) {
+            bits[i] = word[i] == '1';
+        }
+        formatBlock<HammingCode<wordSize>>(hammingCode.encode(bits), block);
+    }
+
+    int decode(const char* block, std::string& decodedMessage) const override {
+        auto decodingResult = hammingCode.decode(parseBlock<HammingCode<wordSize>>(block));
+        for (int i = 0; i < wordSize; i++) {
+            decodedMessage.push_back(decodingResult.first[i] ? '1' : '0');
+        }
+        return decodingResult.second;
+    }
+
+private:
+    const HammingCode<wordSize> hammingCode;
+};
+
+inline const std::vector<std::unique_ptr<RuntimeHammingCode>>& getRateCodes() {
+    /// Codes available for switching, from the most robust to the one with the lowest parity overhead.
+    /// Blocks of all codes except FixedHammingCode take whole powers of two bits.
+    static const auto codes = [] {
+        std::vector<std::unique_ptr<RuntimeHammingCode>> codes;
+        codes.emplace_back(new RuntimeHammingCodeImpl<4>());
+        codes.emplace_back(new RuntimeHammingCodeImpl<11>());
+        codes.emplace_back(new RuntimeHammingCodeImpl<26>());
+        codes.emplace_back(new RuntimeHammingCodeImpl<wordSize>());
+        codes.emplace_back(new RuntimeHammingCodeImpl<57>());
+        codes.emplace_back(new RuntimeHammingCodeImpl<120>());
+        return codes;
+    }();
+    return codes;
+}
+
+inline size_t getFixedCodeIndex() {
+    /// Returns index of the code used by transfers without rate markers.
+    const auto& codes = getRateCodes();
+    for (size_t i = 0; i < codes.size(); i++) {
+        if (codes[i]->getWordSize() == wordSize) {
+            return i;
+        }
+    }
+    throw Poco::BugcheckException("no FixedHammingCode among rate codes");
+}
+
+constexpr char rateMarker = 'R';
+constexpr int rateMarkerSize = 2;
+
+inline std::string makeRateMarker(size_t codeIndex) {
+    return std::string{rateMarker, (char) ('0' + codeIndex)};
+}
+
+inline size_t parseRateMarker(const char* marker) {
+    size_t codeIndex = (size_t) (marker[1] - '0');
+    if (marker[0] != rateMarker || marker[1] < '0' || codeIndex >= getRateCodes().size()) {
+        throw Poco::Exception(Poco::format("bad rate marker: %s", std::string(marker, rateMarkerSize)));
+    }
+    return codeIndex;
+}
+
+template <class Decoder>
+size_t decodeRateStream(const char* data, size_t size, Decoder& decoder, std::string& decodedMessage) {
+    /// Decodes rate markers and blocks in text format with decoder, which switches codes with setCode(codeIndex)
+    /// and decodes blocks of getBlockSize() chars with decode(blocks, count, decodedMessage). Markers may only
+    /// start at block boundaries. Returns count of consumed chars: a marker or a block cut by the end of data
+    /// is left for the next call.
+    size_t decodedSize = 0;
+    while (decodedSize < size) {
+        if (data[decodedSize] == rateMarker) {
+            if (size - decodedSize < rateMarkerSize) {
+                break;
+            }
+            decoder.setCode(parseRateMarker(data + decodedSize));
+            decodedSize += rateMarkerSize;
+            continue;
+        }
+        size_t blockSize = (size_t) decoder.getBlockSize();
+        size_t fullBlocks = 0;
+        while (decodedSize + (fullBlocks + 1) * blockSize <= size
+               && data[decodedSize + fullBlocks * blockSize] != rateMarker) {
+            fullBlocks++;
+        }
+        if (fullBlocks == 0) {
+            break;
+        }
+        decoder.decode(data + decodedSize, fullBlocks, decodedMessage);
+        decodedSize += fullBlocks * blockSize;
+    }
+    return decodedSize;
+}
+
+class RateController
+    /// Estimates bit error rate of the channel from the server feedback
+    /// and chooses the code with the best expected goodput for it.
+{
+public:
+    explicit RateController(size_t codeIndex): codeIndex(codeIndex) {
+    }
+
+    void addFeedback(uint64_t bits, uint64_t single, uint64_t twice, uint64_t many) {
+        if (bits == 0) {
+            return;
+        }
+        // undetectable patterns are rare at the error rates where a code is chosen, so the counts are a lower bound
+        double observed = (double) (single + 2 * twice + 3 * many) / bits;
+        bitErrorRate = hasFeedback ? smoothing * observed + (1 - smoothing) * bitErrorRate : observed;
+        hasFeedback = true;
+
+        const auto& codes = getRateCodes();
+        for (size_t i = 0; i < codes.size(); i++) {
+            if (getGoodput(*codes[i], bitErrorRate) > getGoodput(*codes[codeIndex], bitErrorRate)) {
+                codeIndex = i;
+            }
+        }
+    }
+
+    static double getGoodput(const RuntimeHammingCode& code, double bitErrorRate) {
+        /// Returns share of the channel carrying correctly decoded data bits,
+        /// assuming independent bit errors: a block is decoded if it has at most one error.
+        int n = code.getBlockSize();
+        double correct = std::pow(1 - bitErrorRate, n) + n * bitErrorRate * std::pow(1 - bitErrorRate, n - 1);
+        return (double) code.getWordSize() / n * correct;
+    }
+
+    size_t getCodeIndex() const {
+        return codeIndex;
+    }
+
+    double getBitErrorRate() const {
+        return bitErrorRate;
+    }
+
+private:
+    const double smoothing = 0.5;
+    size_t codeIndex;
+    double bitErrorRate = 0;
+    bool hasFeedback = false;
+};
@@ -0,0 +1,84 @@
+#pragma once
+//
+// Layout of messages encoded with Hamming code.
+//
+// Message bytes are split into bits, least significant bit first, and the bits into words.
+// The last data word is padded with zeros, and one more word holding the padding size is appended.
+// Every word is encoded into a block, and every bit of the block is transferred as '0' or '1' char.
+//
+
+#include <bitset>
+#include <cstddef>
+#include <Poco/Exception.h>
+#include <Poco/Format.h>
+#include "hamming_code.h"
+
+template <class Code>
+std::bitset<Code::getBlockSize()> parseBlock(const char* text) {
+    std::bitset<Code::getBlockSize()> block;
+    for (int i = 0; i < Code::getBlockSize(); i++) {
+        if (text[i] != '1' && text[i] != '0') {
+            throw Poco::Exception(Poco::format("unknown char: %c", text[i]));
+        }
+        block[i] = text[i] == '1';
+    }
+    return block;
+}
+
+template <class Code>
+void formatBlock(const std::bitset<Code::getBlockSize()>& block, char* text) {
+    for (int i = 0; i < Code::getBlockSize(); i++) {
+        text[i] = block[i] ? '1' : '0';
+    }
+}
+
+template <class Code>
+size_t getTailSize(size_t messageSize) {
+    /// Returns count of zero bits padding the last data word. Messages filling whole words
+    /// are followed by a whole word of padding.
+    return Code::getWordSize() - (messageSize * 8) % Code::getWordSize();
+}
+
+template <class Code>
+size_t getEncodedWordsCount(size_t messageSize) {
+    /// Returns count of words, including the tail size word, for message of given size in bytes.
+    return (messageSize * 8 + getTailSize<Code>(messageSize)) / Code::getWordSize() + 1;
+}
+
+template <class Code>
+std::bitset<Code::getWordSize()> readWord(const char* message, size_t messageSize, size_t wordIndex) {
+    /// Returns word with given index of the encoded message layout, tail size word included.
+    if (wordIndex + 1 == getEncodedWordsCount<Code>(messageSize)) {
+        return std::bitset<Code::getWordSize()>(getTailSize<Code>(messageSize));
+    }
+    std::bitset<Code::getWordSize()> word;
+    size_t bitsCount = messageSize * 8;
+    for (size_t i = 0, bit = wordIndex * Code::getWordSize(); i < Code::getWordSize() && bit < bitsCount; i++, bit++) {
+        word[i] = (message[bit / 8] >> (bit % 8)) & 1;
+    }
+    return word;
+}
+
+template <class Code>
+void writeWord(const std::bitset<Code::getWordSize()>& word, size_t wordIndex, char* message, size_t messageSize) {
+    /// Writes bits of the word with given index into zero-initialized message, ignoring bits past its end.
+    size_t bitsCount = messageSize * 8;
+    for (size_t i = 0, bit = wordIndex * Code::getWordSize(); i < Code::getWordSize() && bit < bitsCount; i++, bit++) {
+        if (word[i]) {
+            message[bit / 8] |= (char) (1 << (bit % 8));
+        }
+    }
+}
+
+template <class Code>
+size_t getDecodedSize(size_t wordsCount, size_t tailSize) {
+    /// Returns size in bytes of message decoded from given count of words, tail size word included.
+    if (wordsCount == 0 || tailSize > Code::getWordSize()) {
+        tailSize = 0;
+    }
+    size_t bitsCount = wordsCount * Code::getWordSize();
+    if (bitsCount < tailSize + Code::getWordSize()) {
+        return 0;
+    }
+    return (bitsCount - tailSize - Code::getWordSize()) / 8;
+}
@@ -7,6 +7,8 @@
 #include "Poco/Net/StreamSocket.h"
 #include "Poco/Net/ServerSocket.h"
 #include "Poco/Net/SocketAddress.h"
+#include "Poco/Net/DatagramSocket.h"
+#include "Poco/Timespan.h"
 #include "Poco/Timestamp.h"
 #include "Poco/DateTimeFormatter.h"
 #include "Poco/DateTimeFormat.h"
@@ -18,16 +20,23 @@
 #include "Poco/NumberParser.h"
 #include <algorithm>
 #include <iostream>
+#include <limits>
+#include <random>
 #include <sstream>
+#include <vector>
 #include <fstream>
 #include <Poco/Util/IntValidator.h>
 #include <Poco/Util/OptionException.h>
 #include "hamming_code.h"
+#include "datagram.h"
+#include "adaptive_rate.h"
+#include "shm_ring.h"
 
 
 using Poco::Net::ServerSocket;
 using Poco::Net::SocketAddress;
 using Poco::Net::StreamSocket;
+using Poco::Net::DatagramSocket;
 using Poco::Net::TCPServerConnection;
 using Poco::Net::TCPServerConnectionFactory;
 using Poco::Net::TCPServer;
@@ -68,8 +77,8 @@ protected:
                 .binding("help"));
 
         options.addOption(
-            Option("hostname", "H", "target server hostname")
-                .required(true)
+            Option("hostname", "H", "target server hostname, required unless shm is set")
+                .required(false)
                 .repeatable(false)
                 .argument("<hostname>", true)
                 .binding("hostnameAddress"));
@@ -103,6 +112,50 @@ protected:
                 .argument("<number>", true)
                 .binding("error-count")
                 .validator(new Poco::Util::IntValidator(0, wordSize)));
+
+        options.addOption(
+            Option("udp", "u", "send blocks in datagrams over UDP instead of TCP")
+                .required(false)
+                .repeatable(false)
+                .binding("udp"));
+
+        options.addOption(
+            Option("datagram-size", "d", "maximum size of datagram in bytes")
+                .required(false)
+                .repeatable(false)
+                .argument("<bytes>", true)
+                .binding("datagram-size")
+                .validator(new Poco::Util::IntValidator(
+                    DatagramHeader::size + FixedHammingCode::getBlockSize(), maxDatagramSize)));
+
+        options.addOption(
+            Option("loss-prob", "L", "probability of datagram loss, float")
+                .required(false)
+                .repeatable(false)
+                .argument("<float>", true)
+                .binding("loss-prob")
+                .validator(new ProbabilityValidator()));
+
+        options.addOption(
+            Option("bit-error-prob", "b", "probability of error in every block bit, float")
+                .required(false)
+                .repeatable(false)
+                .argument("<float>", true)
+                .binding("bit-error-prob")
+                .validator(new ProbabilityValidator()));
+
+        options.addOption(
+            Option("adaptive", "a", "switch word size according to error rate feedback from server, TCP only")
+                .required(false)
+                .repeatable(false)
+                .binding("adaptive"));
+
+        options.addOption(
+            Option("shm", "s", "send blocks to server on the same host through shared memory ring with given name")
+                .required(false)
+                .repeatable(false)
+                .argument("<name>", true)
+                .binding("shm"));
     }
 
     virtual void handleOption(const std::string& name, const std::string& value) {
@@ -131,40 +184,242 @@ protected:
         }
         else
         {
-            auto hostname = config().getString("hostnameAddress");
-            unsigned short port = (unsigned short) config().getInt("port", 9911);
+            if (config().hasOption("adaptive") && (config().hasOption("udp") || config().hasOption("shm"))) {
+                app.logger().error("adaptive rate needs feedback from server and is supported over TCP only");
+                return Application::EXIT_USAGE;
+            }
+            if (config().hasOption("udp") && config().hasOption("shm")) {
+                app.logger().error("only one of udp and shm options may be set");
+                return Application::EXIT_USAGE;
+            }
+            if (!config().hasOption("shm") && !config().hasOption("hostnameAddress")) {
+                app.logger().error("hostname option is required");
+                return Application::EXIT_USAGE;
+            }
 
-            app.logger().information("connecting to %s:%hu", hostname, port);
-            StreamSocket socket(SocketAddress(hostname, port));
+            errorProb = config().getDouble("error-prob", 1);
+            errorCount = config().getInt("error-count", 0);
+            bitErrorProb = config().getDouble("bit-error-prob", 0);
 
             auto filename = config().getString("file");
             app.logger().information("reading data from %s", filename);
             std::ifstream messageFile(filename);
             std::stringstream buffer;
             buffer << messageFile.rdbuf();
+            if (config().hasOption("shm")) {
+                auto encoded = encodeMessage(buffer.str());
+                addErrors(encoded);
+                sendShm(encoded, config().getString("shm"));
+                return Application::EXIT_OK;
+            }
+
+            auto hostname = config().getString("hostnameAddress");
+            unsigned short port = (unsigned short) config().getInt("port", 9911);
+            SocketAddress address(hostname, port);
+
+            if (config().hasOption("adaptive")) {
+                sendAdaptive(buffer.str(), address);
+                return Application::EXIT_OK;
+            }
             auto encoded = encodeMessage(buffer.str());
             addErrors(encoded);
 
-            app.logger().debug("sending %d bytes", encoded.length());
-            size_t cur = 0;
-            while (cur != encoded.length()) {
-                cur += socket.sendBytes(encoded.data() + cur, encoded.length() - cur);
+            if (config().hasOption("udp")) {
+                sendDatagrams(encoded, buffer.str().length(), address);
+            } else {
+                sendStream(encoded, address);
             }
+        }
+        return Application::EXIT_OK;
+    }
+
+    void sendStream(const std::string& encoded, const SocketAddress& address) {
+        auto& app = Application::instance();
+        app.logger().information("connecting to %s", address.toString());
+        StreamSocket socket(address);
+
+        app.logger().debug("sending %z bytes", encoded.length());
+        size_t cur = 0;
+        while (cur != encoded.length()) {
+            cur += socket.sendBytes(encoded.data() + cur, encoded.length() - cur);
+        }
+        std::cout << "send finished" << std::endl;
+        socket.shutdownSend();
+        char serverAnswer[1000];
+        cur = 0;
+        int n = socket.receiveBytes(serverAnswer + cur, sizeof(serverAnswer) - cur);
+        while (n > 0) {
+            cur += n;
+            n = socket.receiveBytes(serverAnswer + cur, sizeof(serverAnswer) - cur);
+        }
+        app.logger().information("server answer: %s", std::string(serverAnswer, cur));
+    }
+
+    void sendDatagrams(const std::string& encoded, size_t messageSize, const SocketAddress& address) {
+        /// Sends blocks without retransmission: corrupted blocks are fixed by the code,
+        /// lost datagrams are only reported by the server.
+        auto& app = Application::instance();
+        if (messageSize > std::numeric_limits<uint32_t>::max()) {
+            throw Poco::InvalidArgumentException(Poco::format("message of %z bytes is too large for UDP mode", messageSize));
+        }
+        int blockSize = hammingCode.getBlockSize();
+        int datagramSize = config().getInt("datagram-size", defaultDatagramSize);
+        double lossProb = config().getDouble("loss-prob", 0);
+        uint32_t batchSize = (uint32_t) ((datagramSize - DatagramHeader::size) / blockSize);
+        size_t blocksCount = encoded.length() / blockSize;
+        uint32_t datagramsCount = (uint32_t) ((blocksCount + batchSize - 1) / batchSize);
+        uint32_t transferId = std::random_device()();
+        app.logger().information("sending %u datagrams of %u blocks to %s", datagramsCount, batchSize, address.toString());
+
+        DatagramSocket socket;
+        std::vector<char> datagram(DatagramHeader::size + batchSize * blockSize);
+        int dropped = 0;
+        for (uint32_t sequence = 0; sequence < datagramsCount; sequence++) {
+            size_t firstBlock = (size_t) sequence * batchSize;
+            size_t blocks = std::min<size_t>(batchSize, blocksCount - firstBlock);
+            if (((double) rand() / RAND_MAX) < lossProb) {
+                dropped++;
+                continue;
+            }
+            DatagramHeader{transferId, sequence, datagramsCount, batchSize, (uint32_t) messageSize}.write(datagram.data());
+            std::copy_n(encoded.data() + firstBlock * blockSize, blocks * blockSize, datagram.data() + DatagramHeader::size);
+            socket.sendTo(datagram.data(), (int) (DatagramHeader::size + blocks * blockSize), address);
+        }
+        app.logger().information("dropped datagrams: %d", dropped);
+        std::cout << "send finished" << std::endl;
+
+        if (!socket.poll(answerTimeout, Poco::Net::Socket::SELECT_READ)) {
+            app.logger().warning("no answer from server");
+            return;
+        }
+        char serverAnswer[1000];
+        SocketAddress sender;
+        int n = socket.receiveFrom(serverAnswer, sizeof(serverAnswer), sender);
+        app.logger().information("server answer: %s", std::string(serverAnswer, n));
+    }
+
+    void sendShm(const std::string& encoded, const std::string& name) {
+        /// Writes blocks into the ring shared with the server, which decodes them in place.
+        auto& app = Application::instance();
+        app.logger().information("attaching to shared memory %s", name);
+        auto ring = ShmRing::open(name);
+        if (ring.getBlockSize() != (uint32_t) hammingCode.getBlockSize()) {
+            throw Poco::DataFormatException(Poco::format("ring block size %u differs from %d",
+                ring.getBlockSize(), hammingCode.getBlockSize()));
+        }
+        if (!ring.attach()) {
+            throw Poco::IllegalStateException(Poco::format("shared memory %s is used by another client", name));
+        }
+
+        app.logger().debug("sending %z bytes", encoded.length());
+        if (ring.write(encoded.data(), encoded.length() / hammingCode.getBlockSize(), answerTimeout)) {
+            ring.close();
             std::cout << "send finished" << std::endl;
-            socket.shutdownSend();
-            char serverAnswer[1000];
-            cur = 0;
-            int n = socket.receiveBytes(serverAnswer + cur, sizeof(serverAnswer) - cur);
-            while (n > 0) {
-                cur += n;
-                n = socket.receiveBytes(serverAnswer + cur, sizeof(serverAnswer) - cur);
+        }
+        app.logger().information("server answer: %s", ring.waitForAnswer(answerTimeout));
+    }
+
+    void sendAdaptive(const std::string& message, const SocketAddress& address) {
+        /// Encodes and sends the message chunk by chunk, switching the code
+        /// according to error rate feedback received from the server meanwhile.
+        auto& app = Application::instance();
+        app.logger().information("connecting to %s", address.toString());
+        StreamSocket socket(address);
+
+        const auto& codes = getRateCodes();
+        RateController controller(getFixedCodeIndex());
+        size_t codeIndex = codes.size();
+        auto bits = toBits(message);
+        std::string received;
+        size_t pos = 0;
+        int blocksCount = 0, errorsAdded = 0, switchesCount = 0;
+        bool finished = false;
+        while (!finished) {
+            receiveFeedback(socket, received, controller, false);
+            std::string chunk;
+            if (controller.getCodeIndex() != codeIndex) {
+                codeIndex = controller.getCodeIndex();
+                app.logger().information("switching to word size %d, estimated bit error rate %f",
+                    codes[codeIndex]->getWordSize(), controller.getBitErrorRate());
+                chunk += makeRateMarker(codeIndex);
+                switchesCount++;
+            }
+
+            const auto& code = *codes[codeIndex];
+            size_t k = (size_t) code.getWordSize();
+            auto appendBlock = [&](const std::string& word) {
+                size_t blockStart = chunk.length();
+                chunk.resize(blockStart + code.getBlockSize());
+                code.encode(word.data(), &chunk[blockStart]);
+                errorsAdded += addErrors(&chunk[blockStart], code.getBlockSize());
+                blocksCount++;
+            };
+            for (int i = 0; i < adaptiveChunkBlocks && !finished; i++) {
+                if (pos + k <= bits.length()) {
+                    appendBlock(bits.substr(pos, k));
+                    pos += k;
+                    continue;
+                }
+                // the last data word is padded with zeros and followed by the word with the padding size
+                size_t tail = 0;
+                if (pos != bits.length()) {
+                    auto word = bits.substr(pos);
+                    tail = k - word.length();
+                    word.append(tail, '0');
+                    appendBlock(word);
+                    pos = bits.length();
+                }
+                std::string tailSizeWord;
+                for (size_t value = tail; tailSizeWord.length() < k; value >>= 1) {
+                    tailSizeWord.push_back(value & 1 ? '1' : '0');
+                }
+                appendBlock(tailSizeWord);
+                finished = true;
             }
-            app.logger().information("server answer: %s", std::string(serverAnswer, cur));
+            sendAll(socket, chunk);
         }
-        return Application::EXIT_OK;
+        app.logger().information("blocks: %d, code switches: %d", blocksCount, switchesCount);
+        app.logger().information("added errors: %d", errorsAdded);
+        std::cout << "send finished" << std::endl;
+        socket.shutdownSend();
+        receiveFeedback(socket, received, controller, true);
+        app.logger().information("server answer: %s", received);
     }
 
-    std::string encodeMessage(const std::string& message) {
+    void receiveFeedback(StreamSocket& socket, std::string& received, RateController& controller, bool untilClosed) {
+        /// Receives available data, or all data if untilClosed is set, and consumes complete feedback lines.
+        /// The rest of received data is left in received.
+        const std::string feedbackPrefix = "feedback ";
+        char data[1000];
+        while (untilClosed || socket.poll(Poco::Timespan(0), Poco::Net::Socket::SELECT_READ)) {
+            int n = socket.receiveBytes(data, sizeof(data));
+            if (n <= 0) {
+                break;
+            }
+            received.append(data, n);
+        }
+
+        size_t lineEnd;
+        while (received.compare(0, feedbackPrefix.length(), feedbackPrefix) == 0
+               && (lineEnd = received.find('\n')) != std::string::npos) {
+            std::istringstream line(received.substr(feedbackPrefix.length(), lineEnd - feedbackPrefix.length()));
+            uint64_t bits = 0, single = 0, twice = 0, many = 0;
+            line >> bits >> single >> twice >> many;
+            logger().debug("feedback: %s", received.substr(0, lineEnd));
+            controller.addFeedback(bits, single, twice, many);
+            received.erase(0, lineEnd + 1);
+        }
+    }
+
+    void sendAll(StreamSocket& socket, const std::string& data) {
+        size_t cur = 0;
+        while (cur != data.length()) {
+            cur += socket.sendBytes(data.data() + cur, (int) (data.length() - cur));
+        }
+    }
+
+    std::string toBits(const std::string& message) {
+        /// Returns bits of the message as '0' and '1' chars, least significant bit of every byte first.
         std::string textMessage;
         for (auto c : message) {
             std::bitset<8> b((unsigned long long) c);
@@ -172,6 +427,11 @@ protected:
             std::reverse(s.begin(), s.end());
             textMessage += s;
         }
+        return textMessage;
+    }
+
+    std::string encodeMessage(const std::string& message) {
+        std::string textMessage = toBits(message);
         size_t tail = wordSize - (textMessage.length() % wordSize);
         for (int i = 0; i < tail; i++) {
             textMessage.push_back('0');
@@ -194,25 +454,42 @@ protected:
     }
 
     void addErrors(std::string& data) {
-        double errorProb = config().getDouble("error-prob", 1);
-        int errorCount = config().getInt("error-count", 0);
         int blockSize = hammingCode.getBlockSize();
         logger().information("blocks: %d", (int) (data.length() / blockSize));
         int count = 0;
         for (size_t i = 0; i < data.length() / blockSize; i++) {
-            if (((double) rand() / RAND_MAX) > errorProb) {
-                continue;
-            }
+            count += addErrors(&data[i * blockSize], blockSize);
+        }
+        logger().information("added errors: %d", count);
+    }
+
+    int addErrors(char* block, int blockSize) {
+        /// Flips bits of the block according to error options and returns count of flips.
+        int count = 0;
+        if (((double) rand() / RAND_MAX) <= errorProb) {
             for (size_t j = 0; j < errorCount; j++) {
-                size_t pos = i * blockSize + (rand() % blockSize);
-                data[pos] = data[pos] == '0' ? '1' : '0';
+                size_t pos = rand() % blockSize;
+                block[pos] = block[pos] == '0' ? '1' : '0';
                 count++;
             }
         }
-        logger().information("added errors: %d", count);
+        if (bitErrorProb > 0) {
+            for (int pos = 0; pos < blockSize; pos++) {
+                if (((double) rand() / RAND_MAX) < bitErrorProb) {
+                    block[pos] = block[pos] == '0' ? '1' : '0';
+                    count++;
+                }
+            }
+        }
+        return count;
     }
 private:
     const FixedHammingCode hammingCode;
+    const Poco::Timespan answerTimeout = Poco::Timespan(5, 0);
+    const int adaptiveChunkBlocks = 256;
+    double errorProb = 1;
+    int errorCount = 0;
+    double bitErrorProb = 0;
 };
 
 
@@ -0,0 +1,51 @@
+#pragma once
+//
+// Framing of encoded blocks into datagrams for the UDP transport.
+//
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <Poco/ByteOrder.h>
+
+struct DatagramHeader {
+    /// Header preceding the blocks carried by every datagram.
+    /// Fields are transmitted in network byte order.
+
+    uint32_t transferId;      /// random nonce telling apart transfers of the same sender
+    uint32_t sequence;        /// index of the datagram in the transfer
+    uint32_t datagramsCount;  /// total number of datagrams in the transfer
+    uint32_t batchSize;       /// blocks in every datagram except possibly the last one
+    uint32_t messageSize;     /// size in bytes of the message before encoding, known even if the last datagram is lost
+
+    static constexpr size_t size = 5 * sizeof(uint32_t);
+
+    void write(char* out) const {
+        uint32_t fields[] = {
+            Poco::ByteOrder::toNetwork(transferId),
+            Poco::ByteOrder::toNetwork(sequence),
+            Poco::ByteOrder::toNetwork(datagramsCount),
+            Poco::ByteOrder::toNetwork(batchSize),
+            Poco::ByteOrder::toNetwork(messageSize),
+        };
+        std::memcpy(out, fields, size);
+    }
+
+    static DatagramHeader read(const char* in) {
+        uint32_t fields[5];
+        std::memcpy(fields, in, size);
+        return DatagramHeader{
+            Poco::ByteOrder::fromNetwork(fields[0]),
+            Poco::ByteOrder::fromNetwork(fields[1]),
+            Poco::ByteOrder::fromNetwork(fields[2]),
+            Poco::ByteOrder::fromNetwork(fields[3]),
+            Poco::ByteOrder::fromNetwork(fields[4]),
+        };
+    }
+};
+
+/// Default datagram size that fits into Ethernet MTU without IP fragmentation.
+constexpr int defaultDatagramSize = 1400;
+
+/// Maximum payload of a UDP datagram over IPv4.
+constexpr int maxDatagramSize = 65507;
@@ -0,0 +1,145 @@
+#pragma once
+//
+// Destinations of decoded bytes forwarded by the server while a transfer goes on.
+//
+
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <Poco/Exception.h>
+#include <Poco/Format.h>
+#include <Poco/Net/SocketAddress.h>
+#include <Poco/Net/StreamSocket.h>
+
+class DecodedSink
+{
+public:
+    virtual ~DecodedSink() = default;
+
+    virtual void write(const char* data, size_t length) = 0;
+
+    virtual void flush() = 0;
+        /// Makes written data visible to the reader.
+};
+
+class FileSink: public DecodedSink
+    /// Writes to a regular file or to a named pipe. Opening a pipe blocks until it has a reader.
+{
+public:
+    explicit FileSink(const std::string& path): file(path, std::ios::binary | std::ios::trunc) {
+        if (!file) {
+            throw Poco::OpenFileException(path);
+        }
+    }
+
+    void write(const char* data, size_t length) override {
+        file.write(data, (std::streamsize) length);
+    }
+
+    void flush() override {
+        file.flush();
+        if (!file) {
+            throw Poco::WriteFileException("failed to write decoded data");
+        }
+    }
+
+private:
+    std::ofstream file;
+};
+
+class PipeSink: public DecodedSink
+    /// Writes to a named pipe, which carries data of one connection at a time: writes of concurrent connections
+    /// would interleave in the pipe, so the sink can not be created while another connection uses the pipe.
+{
+public:
+    explicit PipeSink(const std::string& path): lock(path), file(path) {
+    }
+
+    void write(const char* data, size_t length) override {
+        file.write(data, length);
+    }
+
+    void flush() override {
+        file.flush();
+    }
+
+private:
+    class Lock
+    {
+    public:
+        explicit Lock(const std::string& path): path(path) {
+            std::lock_guard<std::mutex> guard(getMutex());
+            if (!getUsedPaths().insert(path).second) {
+                throw Poco::IllegalStateException(Poco::format("pipe %s is used by another connection", path));
+            }
+        }
+
+        ~Lock() {
+            std::lock_guard<std::mutex> guard(getMutex());
+            getUsedPaths().erase(path);
+        }
+
+    private:
+        static std::mutex& getMutex() {
+            static std::mutex mutex;
+            return mutex;
+        }
+
+        static std::set<std::string>& getUsedPaths() {
+            static std::set<std::string> paths;
+            return paths;
+        }
+
+        const std::string path;
+    };
+
+    Lock lock;
+    FileSink file;
+};
+
+class SocketSink: public DecodedSink
+    /// Forwards data to a TCP socket.
+{
+public:
+    explicit SocketSink(const Poco::Net::SocketAddress& address): socket(address) {
+        socket.setNoDelay(true);
+    }
+
+    void write(const char* data, size_t length) override {
+        size_t cur = 0;
+        while (cur != length) {
+            cur += socket.sendBytes(data + cur, (int) (length - cur));
+        }
+    }
+
+    void flush() override {
+    }
+
+private:
+    Poco::Net::StreamSocket socket;
+};
+
+inline void validateSinkSpec(const std::string& spec) {
+    /// Sink is specified as file:<path>, with connection id appended to the path,
+    /// as pipe:<path>, used by one connection at a time, or as tcp:<host>:<port>.
+    auto kind = spec.substr(0, spec.find(':'));
+    if (spec.find(':') == std::string::npos || (kind != "file" && kind != "pipe" && kind != "tcp")) {
+        throw Poco::InvalidArgumentException(Poco::format("bad sink %s, expected file:<path>, pipe:<path> or tcp:<host>:<port>", spec));
+    }
+}
+
+inline std::unique_ptr<DecodedSink> createSink(const std::string& spec, int connectionId) {
+    validateSinkSpec(spec);
+    auto separator = spec.find(':');
+    auto kind = spec.substr(0, separator);
+    auto target = spec.substr(separator + 1);
+    if (kind == "file") {
+        return std::unique_ptr<DecodedSink>(new FileSink(Poco::format("%s_%d.txt", target, connectionId)));
+    } else if (kind == "pipe") {
+        return std::unique_ptr<DecodedSink>(new PipeSink(target));
+    } else {
+        return std::unique_ptr<DecodedSink>(new SocketSink(Poco::Net::SocketAddress(target)));
+    }
+}
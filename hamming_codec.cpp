@@ -0,0 +1,291 @@
+#include "Poco/Exception.h"
+#include "Poco/Timestamp.h"
+#include "Poco/Util/Application.h"
+#include "Poco/Util/Option.h"
+#include "Poco/Util/OptionSet.h"
+#include "Poco/Util/HelpFormatter.h"
+#include "Poco/Util/IntValidator.h"
+#include "Poco/Util/RegExpValidator.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <exception>
+#include <iostream>
+#include <numeric>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "hamming_code.h"
+#include "block_format.h"
+
+
+using Poco::Timestamp;
+using Poco::Util::Application;
+using Poco::Util::Option;
+using Poco::Util::OptionSet;
+using Poco::Util::HelpFormatter;
+
+
+class MappedFile
+    /// Memory mapping of a whole file.
+{
+public:
+    explicit MappedFile(const std::string& path) {
+        /// Maps existing file for reading.
+        fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throwError("failed to open", path);
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            throwError("failed to stat", path);
+        }
+        map(path, (size_t) st.st_size, PROT_READ);
+    }
+
+    MappedFile(const std::string& path, size_t size) {
+        /// Creates or truncates file of given size and maps it for writing.
+        fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            throwError("failed to open", path);
+        }
+        if (ftruncate(fd, (off_t) size) != 0) {
+            throwError("failed to resize", path);
+        }
+        map(path, size, PROT_READ | PROT_WRITE);
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    ~MappedFile() {
+        if (data != nullptr) {
+            munmap(data, size);
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+
+    char* getData() const {
+        return data;
+    }
+
+    size_t getSize() const {
+        return size;
+    }
+
+private:
+    void map(const std::string& path, size_t mapSize, int protection) {
+        size = mapSize;
+        if (size == 0) {
+            return;
+        }
+        void* mapped = mmap(nullptr, size, protection, MAP_SHARED, fd, 0);
+        if (mapped == MAP_FAILED) {
+            throwError("failed to map", path);
+        }
+        data = (char*) mapped;
+        madvise(data, size, MADV_SEQUENTIAL);
+    }
+
+    void throwError(const std::string& action, const std::string& path) {
+        int error = errno;
+        if (fd >= 0) {
+            close(fd);
+            fd = -1;
+        }
+        throw Poco::IOException(Poco::format("%s %s: %s", action, path, std::string(strerror(error))));
+    }
+
+    int fd = -1;
+    char* data = nullptr;
+    size_t size = 0;
+};
+
+
+template <class Task>
+void runInParallel(size_t itemsCount, size_t itemsAlignment, int threadsCount, Task task) {
+    /// Splits items into contiguous ranges, aligned to itemsAlignment, and calls task(begin, end, threadIndex)
+    /// for every range in a separate thread. The first exception thrown by a task is rethrown.
+    size_t rangeSize = (itemsCount + threadsCount - 1) / threadsCount;
+    rangeSize = (rangeSize + itemsAlignment - 1) / itemsAlignment * itemsAlignment;
+    std::vector<std::thread> threads;
+    std::vector<std::exception_ptr> errors((size_t) threadsCount);
+    for (int threadIndex = 0; threadIndex < threadsCount; threadIndex++) {
+        size_t begin = std::min(itemsCount, threadIndex * rangeSize);
+        size_t end = std::min(itemsCount, begin + rangeSize);
+        threads.emplace_back([&, begin, end, threadIndex] {
+            try {
+                task(begin, end, threadIndex);
+            } catch (...) {
+                errors[threadIndex] = std::current_exception();
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    for (auto& error : errors) {
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+}
+
+
+class HammingCodec: public Poco::Util::Application
+{
+protected:
+    void defineOptions(OptionSet& options) override {
+        Application::defineOptions(options);
+
+        options.addOption(
+            Option("help", "h", "display help information on command line arguments")
+                .required(false)
+                .repeatable(false)
+                .binding("help"));
+
+        options.addOption(
+            Option("mode", "m", "encode file into blocks or decode blocks into file")
+                .required(true)
+                .repeatable(false)
+                .argument("<encode|decode>", true)
+                .binding("mode")
+                .validator(new Poco::Util::RegExpValidator("encode|decode")));
+
+        options.addOption(
+            Option("input", "i", "input file")
+                .required(true)
+                .repeatable(false)
+                .argument("<file>", true)
+                .binding("input"));
+
+        options.addOption(
+            Option("output", "o", "output file")
+                .required(true)
+                .repeatable(false)
+                .argument("<file>", true)
+                .binding("output"));
+
+        options.addOption(
+            Option("threads", "t", "number of threads, hardware concurrency by default")
+                .required(false)
+                .repeatable(false)
+                .argument("<number>", true)
+                .binding("threads")
+                .validator(new Poco::Util::IntValidator(1, 1024)));
+    }
+
+    void handleOption(const std::string& name, const std::string& value) override {
+        Application::handleOption(name, value);
+
+        if (name == "help") {
+            stopOptionsProcessing();
+        }
+    }
+
+    void displayHelp()
+    {
+        HelpFormatter helpFormatter(options());
+        helpFormatter.setCommand(commandName());
+        helpFormatter.setUsage("OPTIONS");
+        helpFormatter.setHeader("An offline codec that converts files to and from blocks encoded with Hamming code.");
+        helpFormatter.format(std::cout);
+    }
+
+    int main(const std::vector<std::string>& args) override
+    {
+        if (config().hasOption("help"))
+        {
+            displayHelp();
+            return Application::EXIT_OK;
+        }
+
+        int threadsCount = config().getInt("threads", std::max(1, (int) std::thread::hardware_concurrency()));
+        MappedFile input(config().getString("input"));
+        auto outputFilename = config().getString("output");
+        Timestamp started;
+        if (config().getString("mode") == "encode") {
+            encode(input, outputFilename, threadsCount);
+        } else {
+            decode(input, outputFilename, threadsCount);
+        }
+        double seconds = (double) started.elapsed() / Timestamp::resolution();
+        logger().information("processed %z bytes in %.3f s using %d threads", input.getSize(), seconds, threadsCount);
+        return Application::EXIT_OK;
+    }
+
+    void encode(const MappedFile& input, const std::string& outputFilename, int threadsCount) {
+        size_t wordsCount = getEncodedWordsCount<FixedHammingCode>(input.getSize());
+        MappedFile output(outputFilename, wordsCount * FixedHammingCode::getBlockSize());
+        logger().information("encoding %z bytes into %z blocks", input.getSize(), wordsCount);
+
+        runInParallel(wordsCount, 1, threadsCount, [&](size_t begin, size_t end, int) {
+            for (size_t wordIndex = begin; wordIndex < end; wordIndex++) {
+                auto word = readWord<FixedHammingCode>(input.getData(), input.getSize(), wordIndex);
+                auto block = hammingCode.encode(word);
+                formatBlock<FixedHammingCode>(block, output.getData() + wordIndex * FixedHammingCode::getBlockSize());
+            }
+        });
+    }
+
+    void decode(const MappedFile& input, const std::string& outputFilename, int threadsCount) {
+        constexpr int blockSize = FixedHammingCode::getBlockSize();
+        if (input.getSize() == 0 || input.getSize() % blockSize != 0) {
+            throw Poco::DataFormatException(Poco::format("input size %z is not a positive multiple of block size %d",
+                input.getSize(), blockSize));
+        }
+        size_t wordsCount = input.getSize() / blockSize;
+        auto tailSizeWord = hammingCode.decode(parseBlock<FixedHammingCode>(input.getData() + input.getSize() - blockSize)).first;
+        size_t tailSize = tailSizeWord.to_ulong();
+        if (tailSize > wordSize) {
+            logger().information("bad tail size: %z", tailSize);
+        }
+        MappedFile output(outputFilename, getDecodedSize<FixedHammingCode>(wordsCount, tailSize));
+        logger().information("decoding %z blocks into %z bytes", wordsCount, output.getSize());
+
+        // ranges of words must start at byte boundary, so that threads never write the same byte
+        size_t wordsAlignment = 8 / std::gcd(wordSize, 8);
+        std::vector<std::unordered_map<int, int>> detected((size_t) threadsCount);
+        runInParallel(wordsCount, wordsAlignment, threadsCount, [&](size_t begin, size_t end, int threadIndex) {
+            for (size_t wordIndex = begin; wordIndex < end; wordIndex++) {
+                auto block = parseBlock<FixedHammingCode>(input.getData() + wordIndex * blockSize);
+                auto decodingResult = hammingCode.decode(block);
+                detected[threadIndex][decodingResult.second] += 1;
+                writeWord<FixedHammingCode>(decodingResult.first, wordIndex, output.getData(), output.getSize());
+            }
+        });
+
+        std::unordered_map<int, int> total;
+        for (auto& threadDetected : detected) {
+            for (auto& errors : threadDetected) {
+                total[errors.first] += errors.second;
+            }
+        }
+        std::string stat = Poco::format("detected errors: %d single, %d double, %d many", total[1], total[2], total[-1]);
+        logger().information(stat);
+        std::cout << stat << std::endl;
+    }
+
+private:
+    const FixedHammingCode hammingCode;
+};
+
+
+int main(int argc, char** argv)
+{
+    HammingCodec codec;
+    try {
+        codec.init(argc, argv);
+        return codec.run();
+    }
+    catch (const Poco::Exception& e) {
+        std::cerr << e.displayText() << std::endl;
+    }
+    return 1;
+}
@@ -5,6 +5,14 @@
 #include "Poco/Net/StreamSocket.h"
 #include "Poco/Net/SocketStream.h"
 #include "Poco/Net/ServerSocket.h"
+#include "Poco/Net/DatagramSocket.h"
+#include "Poco/Net/SocketAddress.h"
+#include "Poco/Runnable.h"
+#include "Poco/NumberParser.h"
+#include "Poco/StringTokenizer.h"
+#include "Poco/Thread.h"
+#include "Poco/ThreadPool.h"
+#include "Poco/Timespan.h"
 #include "Poco/Timestamp.h"
 #include "Poco/DateTimeFormatter.h"
 #include "Poco/DateTimeFormat.h"
@@ -15,15 +23,34 @@
 #include "Poco/Util/IntValidator.h"
 #include "Poco/Util/HelpFormatter.h"
 #include <algorithm>
+#include <atomic>
 #include <iostream>
 #include <bitset>
+#include <cmath>
+#include <cstring>
+#include <deque>
 #include <fstream>
+#include <limits>
+#include <map>
+#include <memory>
 #include <unordered_map>
+#include <vector>
 #include <Poco/StreamCopier.h>
 #include "hamming_code.h"
+#include "block_format.h"
+#include "datagram.h"
+#include "adaptive_rate.h"
+#include "shm_ring.h"
+#include "decoded_sink.h"
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
 
 
 using Poco::Net::ServerSocket;
+using Poco::Net::DatagramSocket;
+using Poco::Net::SocketAddress;
 using Poco::Net::StreamSocket;
 using Poco::Net::TCPServerConnection;
 using Poco::Net::TCPServerConnectionFactory;
@@ -38,14 +65,323 @@ using Poco::Util::OptionSet;
 using Poco::Util::HelpFormatter;
 
 
+class BlockDecoder
+    /// Decodes blocks in text format with one of the rate codes and collects statistics of detected errors.
+{
+public:
+    void decode(const char* data, size_t blocksCount, std::string& decodedMessage) {
+        Application& app = Application::instance();
+        for (size_t blockIndex = 0; blockIndex < blocksCount; blockIndex++) {
+            const char *blockStart = data + (blockIndex * code->getBlockSize());
+            app.logger().debug("decoding block %s", std::string(blockStart, code->getBlockSize()));
+            int errorsCount = code->decode(blockStart, decodedMessage);
+            app.logger().debug("decoded to %s", decodedMessage.substr(decodedMessage.length() - code->getWordSize()));
+            detected[errorsCount] += 1;
+            detectedSinceFeedback[errorsCount] += 1;
+        }
+        this->blocksCount += blocksCount;
+        blocksSinceFeedback += blocksCount;
+        bitsSinceFeedback += blocksCount * code->getBlockSize();
+    }
+
+    void setCode(size_t codeIndex) {
+        Application::instance().logger().debug("switched to word size %d", getRateCodes()[codeIndex]->getWordSize());
+        code = getRateCodes()[codeIndex].get();
+        adaptive = true;
+    }
+
+    bool isAdaptive() const {
+        /// Returns whether the client sent rate markers and waits for feedback.
+        return adaptive;
+    }
+
+    int getBlockSize() const {
+        return code->getBlockSize();
+    }
+
+    int getWordSize() const {
+        return code->getWordSize();
+    }
+
+    std::string getStats() {
+        return Poco::format("detected errors: %d single, %d double, %d many", detected[1], detected[2], detected[-1]);
+    }
+
+    size_t getBlocksCount() const {
+        return blocksCount;
+    }
+
+    size_t getBlocksSinceFeedback() const {
+        return blocksSinceFeedback;
+    }
+
+    std::string takeFeedback() {
+        /// Returns feedback line for blocks decoded since the previous call.
+        auto feedback = Poco::format("feedback %z %d %d %d\n", bitsSinceFeedback,
+            detectedSinceFeedback[1], detectedSinceFeedback[2], detectedSinceFeedback[-1]);
+        detectedSinceFeedback.clear();
+        blocksSinceFeedback = 0;
+        bitsSinceFeedback = 0;
+        return feedback;
+    }
+
+private:
+    const RuntimeHammingCode* code = getRateCodes()[getFixedCodeIndex()].get();
+    std::unordered_map<int, int> detected;
+    std::unordered_map<int, int> detectedSinceFeedback;
+    size_t blocksCount = 0;
+    size_t blocksSinceFeedback = 0;
+    size_t bitsSinceFeedback = 0;
+    bool adaptive = false;
+};
+
+
+size_t getDecodedBytesCount(const std::string& decodedMessage, int lastWordSize) {
+    /// Returns count of message bytes in decoded words, reading the tail size from the last word,
+    /// which has size of the code active at the end of the message. Returns 0 for truncated messages.
+    Application& app = Application::instance();
+    if (decodedMessage.length() < (size_t) lastWordSize) {
+        app.logger().warning("decoded message of %z bits has no tail size word", decodedMessage.length());
+        return 0;
+    }
+    size_t tailSize = 0;
+    for (int i = lastWordSize - 1; i >= 0; i--) {
+        tailSize = tailSize * 2 + (decodedMessage[decodedMessage.length() - lastWordSize + i] == '1');
+    }
+    app.logger().information("tail size: %z", tailSize);
+    if (tailSize > (size_t) lastWordSize) {
+        app.logger().information("bad tail size: %z", tailSize);
+        tailSize = 0;
+    }
+    if (decodedMessage.length() < tailSize + lastWordSize) {
+        app.logger().warning("decoded message of %z bits is shorter than its tail", decodedMessage.length());
+        return 0;
+    }
+    return (decodedMessage.length() - tailSize - lastWordSize) / 8;
+}
+
+
+std::string bitsToBytes(const std::string& decodedMessage, size_t bytesCount) {
+    /// Converts first bytesCount * 8 decoded bits to bytes.
+    std::string binaryResult;
+    for (size_t i = 0; i < bytesCount; i++) {
+        auto c = decodedMessage.substr(i * 8, 8);
+        reverse(c.begin(), c.end());
+        std::bitset<8> cc(c);
+        binaryResult.push_back((char) cc.to_ulong());
+    }
+    return binaryResult;
+}
+
+
+void writeDecodedBytes(const std::string& decodedMessage, size_t bytesCount, const std::string& filename) {
+    /// Converts first bytesCount * 8 decoded bits to bytes and writes them to the file.
+    Application& app = Application::instance();
+    std::string binaryResult = bitsToBytes(decodedMessage, bytesCount);
+
+    app.logger().information("writing decoded message of size %z to %s", binaryResult.length(), filename);
+    std::ofstream of(filename);
+    of.write(binaryResult.data(), binaryResult.length());
+    of.close();
+}
+
+
+void writeDecodedMessage(const std::string& decodedMessage, int lastWordSize, const std::string& filename) {
+    /// Converts decoded words to bytes, strips the tail and writes the result to the file.
+    writeDecodedBytes(decodedMessage, getDecodedBytesCount(decodedMessage, lastWordSize), filename);
+}
+
+
+struct DeliveryOptions {
+    /// Incremental delivery of decoded bytes is enabled when sink is set.
+    std::string sink;
+    Poco::Timespan flushInterval;
+    size_t flushBytes;
+};
+
+
+class LatencyHistogram
+    /// Counts latencies in microseconds in constant memory. Buckets split every power of two into quarters,
+    /// so percentiles are reported with at most 25% error.
+{
+public:
+    void add(Timestamp::TimeDiff latency, size_t count) {
+        latency = std::max<Timestamp::TimeDiff>(latency, 0);
+        buckets[getBucket((uint64_t) latency)] += count;
+        totalCount += count;
+        maxLatency = std::max(maxLatency, latency);
+    }
+
+    size_t getCount() const {
+        return totalCount;
+    }
+
+    Timestamp::TimeDiff getPercentile(double percentile) const {
+        /// Returns the upper bound of the bucket holding the percentile, but at most the maximum latency.
+        size_t rank = std::max<size_t>(1, (size_t) std::ceil(percentile * totalCount)), passed = 0;
+        for (size_t i = 0; i < bucketsCount; i++) {
+            passed += buckets[i];
+            if (passed >= rank) {
+                return std::min<Timestamp::TimeDiff>((Timestamp::TimeDiff) getUpperBound(i), maxLatency);
+            }
+        }
+        return maxLatency;
+    }
+
+    Timestamp::TimeDiff getMax() const {
+        return maxLatency;
+    }
+
+    void clear() {
+        std::fill(buckets, buckets + bucketsCount, 0);
+        totalCount = 0;
+        maxLatency = 0;
+    }
+
+private:
+    static constexpr size_t subBuckets = 4;
+    static constexpr size_t bucketsCount = subBuckets * 64;
+
+    static size_t getBucket(uint64_t latency) {
+        if (latency < subBuckets) {
+            return (size_t) latency;
+        }
+        int exponent = 63;
+        while (!(latency >> exponent)) {
+            exponent--;
+        }
+        return subBuckets * (exponent - 1) + (size_t) ((latency >> (exponent - 2)) & (subBuckets - 1));
+    }
+
+    static uint64_t getUpperBound(size_t bucket) {
+        if (bucket < subBuckets) {
+            return bucket;
+        }
+        int exponent = (int) (bucket / subBuckets) + 1;
+        uint64_t step = (uint64_t) 1 << (exponent - 2);
+        return (subBuckets + bucket % subBuckets + 1) * step - 1;
+    }
+
+    size_t buckets[bucketsCount] = {};
+    size_t totalCount = 0;
+    Timestamp::TimeDiff maxLatency = 0;
+};
+
+
+class IncrementalDelivery
+    /// Forwards decoded bytes to a sink while the transfer goes on, flushing them at least every flush interval
+    /// or flush bytes, and measures latency from receiving a block to delivering its bytes. Latency is logged
+    /// every reportFlushIntervals flush intervals, so that streams which never end report it too.
+    /// The last two words may hold padding and the tail size, so they are held back until the end of the message.
+{
+public:
+    IncrementalDelivery(std::unique_ptr<DecodedSink> sink, const DeliveryOptions& options, int connectionId)
+        : sink(std::move(sink))
+        , options(options)
+        , connectionId(connectionId) {
+        for (const auto& code : getRateCodes()) {
+            heldBackBits = std::max(heldBackBits, (size_t) 2 * code->getWordSize());
+        }
+    }
+
+    void addDecoded(size_t blocksCount, const std::string& decodedMessage, const Timestamp& received) {
+        /// Registers blocks received at the given time, which were just decoded to the end of decodedMessage.
+        if (blocksCount > 0) {
+            batches.push_back(Batch{deliveredBytes * 8 + decodedMessage.length(), blocksCount, received});
+        }
+    }
+
+    void deliverIfDue(std::string& decodedMessage, bool timedOut) {
+        size_t bytesCount = decodedMessage.length() > heldBackBits ? (decodedMessage.length() - heldBackBits) / 8 : 0;
+        if (bytesCount > 0 && (timedOut || bytesCount >= options.flushBytes
+                               || lastFlush.isElapsed(options.flushInterval.totalMicroseconds()))) {
+            deliver(decodedMessage, bytesCount);
+        }
+        if (lastReport.isElapsed(reportFlushIntervals * options.flushInterval.totalMicroseconds())) {
+            if (recentLatencies.getCount() > 0) {
+                Application::instance().logger().information("connection %d, last %Ld ms: %s", connectionId,
+                    lastReport.elapsed() / 1000, formatLatencyStats(recentLatencies));
+            }
+            recentLatencies.clear();
+            lastReport.update();
+        }
+    }
+
+    void finish(std::string& decodedMessage, int lastWordSize) {
+        deliver(decodedMessage, getDecodedBytesCount(decodedMessage, lastWordSize));
+        registerLatency(std::numeric_limits<size_t>::max());
+        decodedMessage.clear();
+    }
+
+    size_t getDeliveredBytes() const {
+        return deliveredBytes;
+    }
+
+    std::string getLatencyStats() const {
+        /// Returns receive to deliver latency percentiles over all blocks.
+        return formatLatencyStats(latencies);
+    }
+
+private:
+    struct Batch {
+        size_t endBit;
+        size_t blocksCount;
+        Timestamp received;
+    };
+
+    void deliver(std::string& decodedMessage, size_t bytesCount) {
+        auto bytes = bitsToBytes(decodedMessage, bytesCount);
+        sink->write(bytes.data(), bytes.length());
+        sink->flush();
+        decodedMessage.erase(0, bytesCount * 8);
+        deliveredBytes += bytesCount;
+        lastFlush.update();
+        registerLatency(deliveredBytes * 8);
+    }
+
+    void registerLatency(size_t deliveredBits) {
+        Timestamp delivered;
+        while (!batches.empty() && batches.front().endBit <= deliveredBits) {
+            latencies.add(delivered - batches.front().received, batches.front().blocksCount);
+            recentLatencies.add(delivered - batches.front().received, batches.front().blocksCount);
+            batches.pop_front();
+        }
+    }
+
+    static std::string formatLatencyStats(const LatencyHistogram& histogram) {
+        if (histogram.getCount() == 0) {
+            return "delivery latency: no blocks";
+        }
+        return Poco::format("delivery latency: p50 %.3f ms, p99 %.3f ms, max %.3f ms",
+            (double) histogram.getPercentile(0.5) / 1000, (double) histogram.getPercentile(0.99) / 1000,
+            (double) histogram.getMax() / 1000);
+    }
+
+    const int reportFlushIntervals = 100;
+    std::unique_ptr<DecodedSink> sink;
+    const DeliveryOptions options;
+    const int connectionId;
+    size_t heldBackBits = 0;
+    size_t deliveredBytes = 0;
+    Timestamp lastFlush;
+    std::deque<Batch> batches;
+    LatencyHistogram latencies;
+    LatencyHistogram recentLatencies;
+    Timestamp lastReport;
+};
+
+
 class HammingCodeServerConnection: public TCPServerConnection
     /// This class handles all client connections.
 {
 public:
-    explicit HammingCodeServerConnection(const StreamSocket& s, const std::string& file, int connectionId)
+    explicit HammingCodeServerConnection(const StreamSocket& s, const std::string& file, int connectionId, size_t feedbackInterval,
+                                         const DeliveryOptions& deliveryOptions)
         : TCPServerConnection(s)
         , file(file)
-        , connectionId(connectionId) {
+        , connectionId(connectionId)
+        , feedbackInterval(feedbackInterval)
+        , deliveryOptions(deliveryOptions) {
         buffer = new char[bufSize];
     }
 
@@ -58,23 +394,46 @@ public:
         Application& app = Application::instance();
         try
         {
-            int n = socket().receiveBytes(buffer, bufSize);
-            while (n > 0)
+            if (!deliveryOptions.sink.empty()) {
+                delivery.reset(new IncrementalDelivery(createSink(deliveryOptions.sink, connectionId), deliveryOptions, connectionId));
+                // wake up to flush decoded data even if the client pauses
+                socket().setReceiveTimeout(deliveryOptions.flushInterval);
+            }
+            while (true)
             {
+                int n;
+                try {
+                    n = socket().receiveBytes(buffer + curPos, bufSize - curPos);
+                } catch (Poco::TimeoutException&) {
+                    delivery->deliverIfDue(decodedMessage, true);
+                    continue;
+                }
+                if (n <= 0) {
+                    break;
+                }
+                Timestamp received;
                 curPos += n;
+                size_t blocksCount = decoder.getBlocksCount();
                 decodeAvailableBlocks();
-                n = socket().receiveBytes(buffer + curPos, bufSize - curPos);
+                if (delivery) {
+                    delivery->addDecoded(decoder.getBlocksCount() - blocksCount, decodedMessage, received);
+                    delivery->deliverIfDue(decodedMessage, false);
+                }
             }
-            std::string stat = Poco::format("detected errors: %d single, %d double, %d many", detected[1], detected[2], detected[-1]);
-            app.logger().information("decoded message size: %z", decodedMessage.length());
-            app.logger().information(stat);
-            writeResult();
-            std::cout << "written result" << std::endl;
-            app.logger().information("will send answer %s", stat);
-            int cur = 0;
-            while (cur != stat.length()) {
-                cur += socket().sendBytes(stat.data() + cur, stat.length() - cur);
+            std::string stat = decoder.getStats();
+            if (delivery) {
+                delivery->finish(decodedMessage, decoder.getWordSize());
+                app.logger().information("delivered decoded message of size %z to %s", delivery->getDeliveredBytes(), deliveryOptions.sink);
+                stat += ", " + delivery->getLatencyStats();
+                app.logger().information(stat);
+            } else {
+                app.logger().information("decoded message size: %z", decodedMessage.length());
+                app.logger().information(stat);
+                writeDecodedMessage(decodedMessage, decoder.getWordSize(), Poco::format("%s_%d.txt", file, connectionId));
+                std::cout << "written result" << std::endl;
             }
+            app.logger().information("will send answer %s", stat);
+            sendAll(stat);
             app.logger().information("sent answer to connection %d", connectionId);
         }
         catch (Poco::Exception& exc)
@@ -84,69 +443,35 @@ public:
     }
 
     void decodeAvailableBlocks() {
-        Application& app = Application::instance();
-        int fullBlocks = curPos / hammingCode.getBlockSize();
-        for (int blockIndex = 0; blockIndex < fullBlocks; blockIndex++) {
-            char *blockStart = buffer + (blockIndex * hammingCode.getBlockSize());
-            std::bitset<FixedHammingCode::getBlockSize()> block;
-            for (int i = 0; i < hammingCode.getBlockSize(); i++) {
-                if (blockStart[i] != '1' && blockStart[i] != '0') {
-                    throw Poco::Exception(Poco::format("unknown char: %c", blockStart[i]));
-                }
-                block[i] = blockStart[i] == '1';
-            }
-            app.logger().debug("decoding block %s at %d", block.to_string(), curPos);
-            auto decodingResult = hammingCode.decode(block);
-            auto word = decodingResult.first.to_string();
-            app.logger().debug("decoded to %s", word);
-            detected[decodingResult.second] += 1;
-            std::reverse(word.begin(), word.end());
-            decodedMessage += word;
-        }
-        int decodedSize = fullBlocks * hammingCode.getBlockSize();
-        for (int i = 0; i < curPos % hammingCode.getBlockSize(); i++) {
+        int decodedSize = (int) decodeRateStream(buffer, (size_t) curPos, decoder, decodedMessage);
+        for (int i = 0; i < curPos - decodedSize; i++) {
             buffer[i] = buffer[decodedSize + i];
         }
-        curPos %= hammingCode.getBlockSize();
-    }
+        curPos -= decodedSize;
 
-    void writeResult() {
-        Application& app = Application::instance();
-        std::string binaryResult;
-        auto lastWord = decodedMessage.substr(decodedMessage.length() - wordSize);
-        std::reverse(lastWord.begin(), lastWord.end());
-        std::bitset<wordSize> tailSizeWord(lastWord);
-        size_t tailSize = tailSizeWord.to_ulong();
-        app.logger().information("tail size: %z", tailSize);
-        if (tailSize > wordSize - 1) {
-            app.logger().information("bad tail size: %z", tailSize);
-            tailSize = 0;
+        if (decoder.isAdaptive() && decoder.getBlocksSinceFeedback() >= feedbackInterval) {
+            sendAll(decoder.takeFeedback());
         }
+    }
 
-        for (size_t i = 0; i < (decodedMessage.length() - tailSize - wordSize) / 8; i++) {
-            auto c = decodedMessage.substr(i * 8, 8);
-            reverse(c.begin(), c.end());
-            std::bitset<8> cc(c);
-            binaryResult.push_back((char) cc.to_ulong());
+    void sendAll(const std::string& data) {
+        size_t cur = 0;
+        while (cur != data.length()) {
+            cur += socket().sendBytes(data.data() + cur, (int) (data.length() - cur));
         }
-
-        auto filename = Poco::format("%s_%d.txt", file, connectionId);
-        app.logger().information("writing decoded message of size %z to %s", binaryResult.length(), filename);
-        std::ofstream of(filename);
-        of.write(binaryResult.data(), binaryResult.length());
-        of.close();
     }
 
 private:
-    const FixedHammingCode hammingCode;
+    BlockDecoder decoder;
     const int bufSize = 100000000;
     char *buffer;
     int curPos = 0;
     const std::string& file;
     const int connectionId;
+    const size_t feedbackInterval;
+    const DeliveryOptions& deliveryOptions;
+    std::unique_ptr<IncrementalDelivery> delivery;
     std::string decodedMessage;
-    size_t messageLength;
-    std::unordered_map<int, int> detected;
 };
 
 
@@ -154,22 +479,393 @@ class HammingCodeServerConnectionFactory: public TCPServerConnectionFactory
     /// A factory for HammingCodeServerConnection.
 {
 public:
-    explicit HammingCodeServerConnectionFactory(const std::string& file): file(file) {
+    HammingCodeServerConnectionFactory(const std::string& file, size_t feedbackInterval, const DeliveryOptions& deliveryOptions)
+        : file(file)
+        , feedbackInterval(feedbackInterval)
+        , deliveryOptions(deliveryOptions) {
     }
 
     TCPServerConnection* createConnection(const StreamSocket& socket) final
     {
-        return (TCPServerConnection *) new HammingCodeServerConnection(socket, file, lastConnectionId++);
+        return (TCPServerConnection *) new HammingCodeServerConnection(socket, file, lastConnectionId++, feedbackInterval, deliveryOptions);
     }
 
 private:
-    const std::string& file;
+    const std::string file;
+    const size_t feedbackInterval;
+    const DeliveryOptions deliveryOptions;
     static int lastConnectionId;
 };
 
 int HammingCodeServerConnectionFactory::lastConnectionId = 0;
 
 
+class HammingCodeDatagramServer: public Poco::Runnable
+    /// Receives transfers in UDP mode. Every datagram is decoded independently
+    /// of the others and the decoded words are reassembled in sequence order.
+    /// Lost datagrams are not retransmitted: they are reported and replaced with zeros.
+    /// Transfers are told apart by sender and transfer id, and finished transfers are remembered for a while,
+    /// so that duplicated or late datagrams do not start a new transfer.
+{
+public:
+    HammingCodeDatagramServer(const SocketAddress& address, const std::string& file, Poco::Timespan idleTimeout,
+                              size_t maxMessageSize)
+        : socket(address)
+        , file(file)
+        , idleTimeout(idleTimeout)
+        , maxMessageSize(maxMessageSize) {
+        socket.setReceiveBufferSize(receiveBufferSize);
+    }
+
+    void run() final
+    {
+        Application& app = Application::instance();
+        std::vector<char> datagram(maxDatagramSize);
+        while (!stopped)
+        {
+            try
+            {
+                if (socket.poll(pollTimeout, Poco::Net::Socket::SELECT_READ)) {
+                    SocketAddress sender;
+                    int n = socket.receiveFrom(datagram.data(), (int) datagram.size(), sender);
+                    receiveDatagram(datagram.data(), n, sender);
+                }
+                finishIdleTransfers();
+            }
+            catch (Poco::Exception& exc)
+            {
+                app.logger().error("DatagramServer: %s", exc.displayText());
+            }
+            catch (std::exception& exc)
+            {
+                app.logger().error("DatagramServer: %s", std::string(exc.what()));
+            }
+        }
+    }
+
+    void stop() {
+        stopped = true;
+    }
+
+private:
+    typedef std::pair<std::string, uint32_t> TransferKey;
+
+    struct Transfer {
+        SocketAddress sender;
+        int connectionId;
+        DatagramHeader header;  /// header of the first received datagram
+        std::map<uint32_t, std::string> decodedWords;
+        BlockDecoder decoder;
+        Timestamp lastReceived;
+    };
+
+    void receiveDatagram(const char* datagram, int length, const SocketAddress& sender) {
+        Application& app = Application::instance();
+        if (length < (int) DatagramHeader::size) {
+            app.logger().warning("ignoring datagram of size %d from %s", length, sender.toString());
+            return;
+        }
+        auto header = DatagramHeader::read(datagram);
+        size_t payloadSize = length - DatagramHeader::size;
+        TransferKey key(sender.toString(), header.transferId);
+        if (header.messageSize > maxMessageSize) {
+            app.logger().warning("ignoring datagram of message of %u bytes from %s, larger than %z bytes",
+                header.messageSize, key.first, maxMessageSize);
+            return;
+        }
+        if (header.batchSize == 0 || header.datagramsCount != getDatagramsCount(header)) {
+            app.logger().warning("ignoring datagram with bad header from %s", key.first);
+            return;
+        }
+        if (header.sequence >= header.datagramsCount
+                || payloadSize != getBlocksCount(header, header.sequence) * FixedHammingCode::getBlockSize()) {
+            app.logger().warning("ignoring datagram %u of %z bytes from %s", header.sequence, payloadSize, key.first);
+            return;
+        }
+        if (finishedTransfers.count(key)) {
+            app.logger().debug("ignoring late datagram %u of finished transfer from %s", header.sequence, key.first);
+            return;
+        }
+
+        auto it = transfers.find(key);
+        if (it == transfers.end()) {
+            it = transfers.emplace(key, Transfer()).first;
+            it->second.sender = sender;
+            it->second.connectionId = lastConnectionId++;
+            it->second.header = header;
+            app.logger().information("started transfer %d of %u datagrams from %s",
+                it->second.connectionId, header.datagramsCount, key.first);
+        }
+        auto& transfer = it->second;
+        if (header.datagramsCount != transfer.header.datagramsCount || header.batchSize != transfer.header.batchSize
+                || header.messageSize != transfer.header.messageSize) {
+            app.logger().warning("ignoring datagram %u from %s not matching its transfer", header.sequence, key.first);
+            return;
+        }
+        if (transfer.decodedWords.count(header.sequence)) {
+            app.logger().warning("ignoring datagram %u from %s", header.sequence, key.first);
+            return;
+        }
+
+        std::string decoded;
+        transfer.decoder.decode(datagram + DatagramHeader::size, getBlocksCount(header, header.sequence), decoded);
+        transfer.decodedWords.emplace(header.sequence, std::move(decoded));
+        transfer.lastReceived.update();
+
+        if (transfer.decodedWords.size() == transfer.header.datagramsCount) {
+            finishTransfer(transfer);
+            finishedTransfers.emplace(key, Timestamp());
+            transfers.erase(it);
+        }
+    }
+
+    static size_t getDatagramsCount(const DatagramHeader& header) {
+        /// Returns count of datagrams carrying the message described by the header.
+        return (getEncodedWordsCount<FixedHammingCode>(header.messageSize) + header.batchSize - 1) / header.batchSize;
+    }
+
+    static size_t getBlocksCount(const DatagramHeader& header, uint32_t sequence) {
+        /// Returns count of blocks in the datagram with given sequence number, the last one carrying the rest.
+        size_t blocksCount = getEncodedWordsCount<FixedHammingCode>(header.messageSize);
+        return std::min<size_t>(header.batchSize, blocksCount - (size_t) sequence * header.batchSize);
+    }
+
+    void finishIdleTransfers() {
+        for (auto it = transfers.begin(); it != transfers.end();) {
+            if (it->second.lastReceived.isElapsed(idleTimeout.totalMicroseconds())) {
+                finishTransfer(it->second);
+                finishedTransfers.emplace(it->first, Timestamp());
+                it = transfers.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        for (auto it = finishedTransfers.begin(); it != finishedTransfers.end();) {
+            if (it->second.isElapsed(finishedTransfersTimeouts * idleTimeout.totalMicroseconds())) {
+                it = finishedTransfers.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    void finishTransfer(Transfer& transfer) {
+        Application& app = Application::instance();
+        std::string decodedMessage;
+        // a transfer with most datagrams lost is not worth zero-filling the whole message in memory
+        bool written = transfer.decodedWords.size() * 2 >= transfer.header.datagramsCount;
+        std::vector<std::pair<uint32_t, uint32_t>> lostRanges;
+        for (uint32_t sequence = 0; sequence < transfer.header.datagramsCount; sequence++) {
+            auto it = transfer.decodedWords.find(sequence);
+            if (it != transfer.decodedWords.end()) {
+                if (written) {
+                    decodedMessage += it->second;
+                }
+                continue;
+            }
+            if (!lostRanges.empty() && lostRanges.back().second + 1 == sequence) {
+                lostRanges.back().second = sequence;
+            } else {
+                lostRanges.emplace_back(sequence, sequence);
+            }
+            if (written) {
+                decodedMessage.append(getBlocksCount(transfer.header, sequence) * wordSize, '0');
+            }
+        }
+
+        std::string lost = Poco::format("lost datagrams: %z", transfer.header.datagramsCount - transfer.decodedWords.size());
+        for (size_t i = 0; i < lostRanges.size(); i++) {
+            lost += i == 0 ? " (" : ", ";
+            lost += lostRanges[i].first == lostRanges[i].second
+                ? Poco::format("%u", lostRanges[i].first)
+                : Poco::format("%u-%u", lostRanges[i].first, lostRanges[i].second);
+        }
+        if (!lostRanges.empty()) {
+            lost += ")";
+        }
+
+        std::string stat = transfer.decoder.getStats() + ", " + lost;
+        if (written) {
+            app.logger().information("decoded message size: %z", decodedMessage.length());
+            app.logger().information(stat);
+            // the message size is known from the headers, so the tail size word may be lost with the last datagram
+            writeDecodedBytes(decodedMessage, transfer.header.messageSize, Poco::format("%s_%d.txt", file, transfer.connectionId));
+        } else {
+            stat += ", not written: less than half of datagrams received";
+            app.logger().warning("transfer %d: %s", transfer.connectionId, stat);
+        }
+        socket.sendTo(stat.data(), (int) stat.length(), transfer.sender);
+        app.logger().information("sent answer to transfer %d", transfer.connectionId);
+    }
+
+    const int receiveBufferSize = 1 << 23;
+    const Poco::Timespan pollTimeout = Poco::Timespan(0, 100000);
+    DatagramSocket socket;
+    const std::string file;
+    const Poco::Timespan idleTimeout;
+    const size_t maxMessageSize;
+    /// finished transfers are remembered for this count of idle timeouts
+    const int finishedTransfersTimeouts = 10;
+    std::map<TransferKey, Transfer> transfers;
+    std::map<TransferKey, Timestamp> finishedTransfers;
+    std::atomic<bool> stopped{false};
+    int lastConnectionId = 0;
+};
+
+
+class HammingCodeShmServer: public Poco::Runnable
+    /// Receives transfers from clients on the same host through the shared memory ring.
+    /// Blocks are decoded in place, without copying them out of the ring.
+{
+public:
+    HammingCodeShmServer(const std::string& name, uint64_t capacity, const std::string& file)
+        : ring(ShmRing::create(name, FixedHammingCode::getBlockSize(), capacity))
+        , file(file) {
+    }
+
+    void run() final
+    {
+        Application& app = Application::instance();
+        while (!stopped)
+        {
+            try
+            {
+                auto events = ring.getEvents();
+                // the state is read first, so that all blocks are available when the ring is closed
+                auto state = ring.getState();
+                if (state == ShmRing::ATTACHED || state == ShmRing::CLOSED) {
+                    const char* blocks;
+                    uint64_t blocksCount = ring.available(blocks);
+                    if (blocksCount > 0) {
+                        decoder.decode(blocks, blocksCount, decodedMessage);
+                        ring.consume(blocksCount);
+                        continue;
+                    }
+                    if (state == ShmRing::CLOSED) {
+                        finishTransfer();
+                        continue;
+                    }
+                }
+                if (ring.releaseIfClientDied()) {
+                    app.logger().warning("released shared memory ring of a client that exited");
+                    resetTransfer();
+                    continue;
+                }
+                ring.wait(events, pollTimeout);
+            }
+            catch (Poco::Exception& exc)
+            {
+                app.logger().error("ShmServer: %s", exc.displayText());
+                // the client may still write, so the ring is emptied only when the client releases it
+                ring.fail(exc.displayText());
+                resetTransfer();
+            }
+            catch (std::exception& exc)
+            {
+                app.logger().error("ShmServer: %s", std::string(exc.what()));
+                ring.fail(exc.what());
+                resetTransfer();
+            }
+        }
+    }
+
+    void stop() {
+        stopped = true;
+    }
+
+private:
+    void finishTransfer() {
+        Application& app = Application::instance();
+        int connectionId = lastConnectionId++;
+        std::string stat = decoder.getStats();
+        app.logger().information("decoded message size: %z", decodedMessage.length());
+        app.logger().information(stat);
+        writeDecodedMessage(decodedMessage, wordSize, Poco::format("%s_%d.txt", file, connectionId));
+        ring.answer(stat);
+        app.logger().information("sent answer to transfer %d", connectionId);
+        resetTransfer();
+    }
+
+    void resetTransfer() {
+        decoder = BlockDecoder();
+        decodedMessage.clear();
+    }
+
+    const Poco::Timespan pollTimeout = Poco::Timespan(0, 100000);
+    ShmRing ring;
+    const std::string file;
+    BlockDecoder decoder;
+    std::string decodedMessage;
+    std::atomic<bool> stopped{false};
+    int lastConnectionId = 0;
+};
+
+
+class CpuSet
+    /// Set of CPUs the server threads may run on.
+{
+public:
+    static CpuSet parse(const std::string& list) {
+        /// Parses list in the format of Linux cpulist files, e.g. "0-7,16-23".
+        CpuSet cpuSet;
+        Poco::StringTokenizer ranges(list, ",", Poco::StringTokenizer::TOK_IGNORE_EMPTY | Poco::StringTokenizer::TOK_TRIM);
+        for (const auto& range : ranges) {
+            auto dash = range.find('-');
+            int first = Poco::NumberParser::parse(range.substr(0, dash));
+            int last = dash == std::string::npos ? first : Poco::NumberParser::parse(range.substr(dash + 1));
+            if (first < 0 || last < first) {
+                throw Poco::InvalidArgumentException(Poco::format("bad CPU range: %s", range));
+            }
+            for (int cpu = first; cpu <= last; cpu++) {
+                cpuSet.cpus.push_back(cpu);
+            }
+        }
+        if (cpuSet.cpus.empty()) {
+            throw Poco::InvalidArgumentException(Poco::format("empty CPU list: %s", list));
+        }
+        return cpuSet;
+    }
+
+    static CpuSet ofNumaNode(int node) {
+        auto path = Poco::format("/sys/devices/system/node/node%d/cpulist", node);
+        std::ifstream cpuList(path);
+        std::string list;
+        if (!std::getline(cpuList, list)) {
+            throw Poco::NotFoundException(Poco::format("failed to read CPUs of NUMA node %d from %s", node, path));
+        }
+        return parse(list);
+    }
+
+    void pinCurrentThread() const {
+        /// Threads started by the pinned thread afterwards inherit its affinity.
+#ifdef __linux__
+        cpu_set_t mask;
+        CPU_ZERO(&mask);
+        for (int cpu : cpus) {
+            CPU_SET(cpu, &mask);
+        }
+        int error = pthread_setaffinity_np(pthread_self(), sizeof(mask), &mask);
+        if (error != 0) {
+            throw Poco::SystemException(Poco::format("failed to set CPU affinity to %s: %s", toString(), std::string(strerror(error))));
+        }
+#else
+        throw Poco::NotImplementedException("CPU affinity is supported on Linux only");
+#endif
+    }
+
+    std::string toString() const {
+        std::string result;
+        for (int cpu : cpus) {
+            result += (result.empty() ? "" : ",") + std::to_string(cpu);
+        }
+        return result;
+    }
+
+private:
+    std::vector<int> cpus;
+};
+
+
 class HammingCodeClient: public Poco::Util::ServerApplication
 {
 protected:
@@ -184,8 +880,8 @@ protected:
                 .binding("help"));
 
         options.addOption(
-            Option("hostname", "H", "hostname to bind socket")
-                .required(true)
+            Option("hostname", "H", "hostname to bind socket, required unless shm is set")
+                .required(false)
                 .repeatable(false)
                 .argument("<hostname>", true)
                 .binding("hostAddress"));
@@ -199,11 +895,128 @@ protected:
                 .validator(new Poco::Util::IntValidator(0, (1 << 16) - 1)));
 
         options.addOption(
-            Option("file", "f", "output file name; connection id will be appended")
+            Option("file", "f", "output file name; connection id will be appended. Not used by TCP connections with sink")
                 .required(false)
                 .repeatable(false)
                 .argument("<file>", true)
                 .binding("file"));
+
+        options.addOption(
+            Option("udp", "u", "receive datagrams over UDP instead of TCP connections")
+                .required(false)
+                .repeatable(false)
+                .binding("udp"));
+
+        options.addOption(
+            Option("udp-timeout", "t", "milliseconds without datagrams after which UDP transfer is finished")
+                .required(false)
+                .repeatable(false)
+                .argument("<ms>", true)
+                .binding("udpTimeout")
+                .validator(new Poco::Util::IntValidator(1, 3600 * 1000)));
+
+        options.addOption(
+            Option("udp-max-message-size", "m", "maximum size in bytes of message received in UDP mode, "
+                                                "larger transfers are ignored; 16777216 by default")
+                .required(false)
+                .repeatable(false)
+                .argument("<bytes>", true)
+                .binding("udpMaxMessageSize")
+                .validator(new Poco::Util::IntValidator(1, std::numeric_limits<int>::max())));
+
+        options.addOption(
+            Option("feedback-interval", "b", "blocks between error rate feedbacks sent to adaptive rate clients")
+                .required(false)
+                .repeatable(false)
+                .argument("<blocks>", true)
+                .binding("feedbackInterval")
+                .validator(new Poco::Util::IntValidator(1, 1 << 30)));
+
+        options.addOption(
+            Option("config-file", "c", "load configuration from file, with keys named as option bindings")
+                .required(false)
+                .repeatable(true)
+                .argument("<file>", true));
+
+        options.addOption(
+            Option("max-threads", "T", "maximum number of connection threads, 16 by default")
+                .required(false)
+                .repeatable(false)
+                .argument("<number>", true)
+                .binding("maxThreads")
+                .validator(new Poco::Util::IntValidator(1, 4096)));
+
+        options.addOption(
+            Option("max-queued", "Q", "maximum number of connections waiting for a thread, "
+                                      "connections beyond it are closed at once; 64 by default")
+                .required(false)
+                .repeatable(false)
+                .argument("<number>", true)
+                .binding("maxQueued")
+                .validator(new Poco::Util::IntValidator(1, 1 << 20)));
+
+        options.addOption(
+            Option("thread-idle-time", "I", "seconds after which idle connection thread is stopped, 10 by default")
+                .required(false)
+                .repeatable(false)
+                .argument("<seconds>", true)
+                .binding("threadIdleTime")
+                .validator(new Poco::Util::IntValidator(1, 24 * 3600)));
+
+        options.addOption(
+            Option("cpus", "C", "pin server threads to CPUs, e.g. 0-7,16-23")
+                .required(false)
+                .repeatable(false)
+                .argument("<list>", true)
+                .binding("cpus"));
+
+        options.addOption(
+            Option("numa-node", "N", "pin server threads to CPUs of NUMA node")
+                .required(false)
+                .repeatable(false)
+                .argument("<node>", true)
+                .binding("numaNode")
+                .validator(new Poco::Util::IntValidator(0, 1023)));
+
+        options.addOption(
+            Option("shm", "s", "receive blocks from clients on the same host through shared memory ring with given name")
+                .required(false)
+                .repeatable(false)
+                .argument("<name>", true)
+                .binding("shm"));
+
+        options.addOption(
+            Option("shm-blocks", "S", "capacity of shared memory ring in blocks")
+                .required(false)
+                .repeatable(false)
+                .argument("<blocks>", true)
+                .binding("shmBlocks")
+                .validator(new Poco::Util::IntValidator(1, 1 << 30)));
+
+        options.addOption(
+            Option("sink", "k", "forward decoded data of TCP connections while receiving it, instead of writing "
+                                "the file at the end: file:<path> (connection id is appended), pipe:<path> (connections "
+                                "are refused while another one uses the pipe) or tcp:<host>:<port>")
+                .required(false)
+                .repeatable(false)
+                .argument("<sink>", true)
+                .binding("sink"));
+
+        options.addOption(
+            Option("flush-interval", "F", "maximum milliseconds between flushes of decoded data to sink, 100 by default")
+                .required(false)
+                .repeatable(false)
+                .argument("<ms>", true)
+                .binding("flushInterval")
+                .validator(new Poco::Util::IntValidator(1, 3600 * 1000)));
+
+        options.addOption(
+            Option("flush-bytes", "B", "decoded bytes that trigger flush to sink, 65536 by default")
+                .required(false)
+                .repeatable(false)
+                .argument("<bytes>", true)
+                .binding("flushBytes")
+                .validator(new Poco::Util::IntValidator(1, 1 << 30)));
     }
 
     void handleOption(const std::string& name, const std::string& value)
@@ -213,6 +1026,9 @@ protected:
         if (name == "help") {
             stopOptionsProcessing();
         }
+        if (name == "config-file") {
+            loadConfiguration(value);
+        }
     }
 
     void displayHelp()
@@ -224,6 +1040,17 @@ protected:
         helpFormatter.format(std::cout);
     }
 
+    void validateConfiguration()
+    {
+        /// Checks values loaded from configuration files, which bypass option validators,
+        /// with validators of the options bound to them.
+        for (const auto& option : options()) {
+            if (option.validator() != nullptr && !option.binding().empty() && config().hasOption(option.binding())) {
+                option.validator()->validate(option, config().getString(option.binding()));
+            }
+        }
+    }
+
     int main(const std::vector<std::string>& args)
     {
         auto& app = Application::instance();
@@ -233,20 +1060,114 @@ protected:
         }
         else
         {
+            try
+            {
+                validateConfiguration();
+            }
+            catch (Poco::InvalidArgumentException& exc)
+            {
+                app.logger().error("bad configuration: %s", exc.displayText());
+                return Application::EXIT_CONFIG;
+            }
+            if (config().hasOption("cpus") && config().hasOption("numaNode"))
+            {
+                app.logger().error("only one of cpus and numa-node options may be set");
+                return Application::EXIT_USAGE;
+            }
+            if (config().hasOption("shm") && config().hasOption("udp"))
+            {
+                app.logger().error("only one of shm and udp options may be set");
+                return Application::EXIT_USAGE;
+            }
+            if (!config().hasOption("shm") && !config().hasOption("hostAddress"))
+            {
+                app.logger().error("hostname option is required");
+                return Application::EXIT_USAGE;
+            }
+            // decoded data of TCP connections goes to the sink instead of the file when it is set
+            if (!config().hasOption("file")
+                && (!config().hasOption("sink") || config().hasOption("udp") || config().hasOption("shm")))
+            {
+                app.logger().error("file option is required unless sink is set for TCP connections");
+                return Application::EXIT_USAGE;
+            }
+            auto file = config().getString("file", "");
+            if (config().hasOption("cpus") || config().hasOption("numaNode"))
+            {
+                // all server threads are started from this one and inherit the affinity
+                auto cpuSet = config().hasOption("cpus")
+                    ? CpuSet::parse(config().getString("cpus"))
+                    : CpuSet::ofNumaNode(config().getInt("numaNode"));
+                cpuSet.pinCurrentThread();
+                app.logger().information("pinned server threads to CPUs %s", cpuSet.toString());
+            }
+
+            if (config().hasOption("shm"))
+            {
+                auto name = config().getString("shm");
+                uint64_t capacity = (uint64_t) config().getInt("shmBlocks", 1 << 16);
+                app.logger().information("will receive blocks through shared memory %s of %z blocks", name, (size_t) capacity);
+                HammingCodeShmServer srv(name, capacity, file);
+                Poco::Thread thread;
+                thread.start(srv);
+                waitForTerminationRequest();
+                srv.stop();
+                thread.join();
+                return Application::EXIT_OK;
+            }
+
             auto hostAddress = config().getString("hostAddress");
             unsigned short port = (unsigned short) config().getInt("port", 9911);
             app.logger().information("will bind to %s:%hu", hostAddress, port);
+            SocketAddress address(hostAddress, port);
+
+            if (config().hasOption("udp"))
+            {
+                auto idleTimeout = config().getInt("udpTimeout", 1000) * Poco::Timespan::MILLISECONDS;
+                size_t maxMessageSize = (size_t) config().getInt("udpMaxMessageSize", 1 << 24);
+                HammingCodeDatagramServer srv(address, file, idleTimeout, maxMessageSize);
+                Poco::Thread thread;
+                thread.start(srv);
+                waitForTerminationRequest();
+                srv.stop();
+                thread.join();
+            }
+            else
+            {
+                size_t feedbackInterval = (size_t) config().getInt("feedbackInterval", 1000);
+                DeliveryOptions deliveryOptions{
+                    config().getString("sink", ""),
+                    config().getInt("flushInterval", 100) * Poco::Timespan::MILLISECONDS,
+                    (size_t) config().getInt("flushBytes", 1 << 16),
+                };
+                if (!deliveryOptions.sink.empty()) {
+                    validateSinkSpec(deliveryOptions.sink);
+                    app.logger().information("will deliver decoded data to %s", deliveryOptions.sink);
+                }
+                int maxThreads = config().getInt("maxThreads", 16);
+                int maxQueued = config().getInt("maxQueued", 64);
+                int threadIdleTime = config().getInt("threadIdleTime", 10);
+                app.logger().information("max threads: %d, max queued connections: %d, thread idle time: %d s",
+                    maxThreads, maxQueued, threadIdleTime);
 
-            // set-up a server socket
-            ServerSocket svs(Poco::Net::SocketAddress(hostAddress, port));
-            // set-up a TCPServer instance
-            TCPServer srv(new HammingCodeServerConnectionFactory(config().getString("file")), svs);
-            // start the TCPServer
-            srv.start();
-            // wait for CTRL-C or kill
-            waitForTerminationRequest();
-            // Stop the TCPServer
-            srv.stop();
+                auto params = new Poco::Net::TCPServerParams;
+                params->setMaxThreads(maxThreads);
+                params->setMaxQueued(maxQueued);
+                params->setThreadIdleTime(Poco::Timespan(threadIdleTime, 0));
+                Poco::ThreadPool threadPool(std::min(2, maxThreads), maxThreads, threadIdleTime);
+                // set-up a server socket
+                ServerSocket svs(address);
+                // set-up a TCPServer instance
+                TCPServer srv(new HammingCodeServerConnectionFactory(file, feedbackInterval, deliveryOptions), threadPool, svs, params);
+                // start the TCPServer
+                srv.start();
+                // wait for CTRL-C or kill
+                waitForTerminationRequest();
+                // Stop the TCPServer
+                srv.stop();
+                app.logger().information("total connections: %d, refused because of full queue: %d",
+                    srv.totalConnections(), srv.refusedConnections());
+            }
         }
         return Application::EXIT_OK;
     }
@@ -0,0 +1,372 @@
+#pragma once
+//
+// Transport between client and server on the same host: a lock-free single producer, single consumer ring
+// of encoded blocks in POSIX shared memory. The server creates the segment and decodes blocks in place,
+// the client attaches to it, writes blocks and waits for the answer put into the segment by the server.
+// Both sides sleep on a futex in the segment when there is nothing to do.
+//
+// The segment stores the server pid, so a segment is replaced by a new server only when its server is dead.
+// The ring is taken by storing the client pid, so the server releases it when the client dies. The client gives up
+// when the server makes no progress for a timeout. The indices are reset only when the ring is released, after the
+// client stopped writing.
+//
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <string>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <Poco/Exception.h>
+#include <Poco/Format.h>
+#include <Poco/Timespan.h>
+#include <Poco/Timestamp.h>
+#ifdef __linux__
+#include <climits>
+#include <ctime>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#else
+#include <chrono>
+#include <thread>
+#endif
+
+class ShmRing
+{
+public:
+    enum State: uint32_t {
+        IDLE,      /// waiting for a client
+        ATTACHED,  /// client writes blocks
+        CLOSED,    /// client wrote all blocks
+        ANSWERED,  /// server decoded all blocks and put the answer
+        FAILED,    /// server failed to decode the blocks and put the error as the answer
+    };
+
+    static ShmRing create(const std::string& name, uint32_t blockSize, uint64_t capacity) {
+        /// Creates segment for ring of capacity blocks. A segment with the same name is replaced
+        /// only if it is not a ring or its server no longer exists.
+        // the segment is unlinked by the ring only once it was created here
+        ShmRing ring(getPath(name), false);
+        int fd = shm_open(ring.path.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+        if (fd < 0 && errno == EEXIST) {
+            int32_t serverPid = getServerPid(name);
+            if (serverPid != 0 && isProcessAlive(serverPid)) {
+                throw Poco::FileExistsException(Poco::format("shared memory %s is used by server %d", ring.path, (int) serverPid));
+            }
+            shm_unlink(ring.path.c_str());
+            fd = shm_open(ring.path.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+        }
+        if (fd < 0) {
+            throwError("failed to create shared memory", ring.path);
+        }
+        ring.owner = true;
+        ring.map(fd, sizeof(Header) + blockSize * capacity, true);
+        new (ring.header) Header();
+        ring.header->blockSize = blockSize;
+        ring.header->capacity = capacity;
+        ring.header->serverPid = (int32_t) getpid();
+        ring.header->magic = magic;
+        return ring;
+    }
+
+    static ShmRing open(const std::string& name) {
+        ShmRing ring(getPath(name), false);
+        int fd = shm_open(ring.path.c_str(), O_RDWR, 0);
+        if (fd < 0) {
+            throwError("failed to open shared memory", ring.path);
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(Header)) {
+            ::close(fd);
+            throw Poco::DataFormatException(Poco::format("%s is not a block ring", ring.path));
+        }
+        ring.map(fd, (size_t) st.st_size, false);
+        if (ring.header->magic != magic || ring.size != sizeof(Header) + ring.header->blockSize * ring.header->capacity) {
+            throw Poco::DataFormatException(Poco::format("%s is not a block ring", ring.path));
+        }
+        return ring;
+    }
+
+    ShmRing(ShmRing&& other) noexcept
+        : path(std::move(other.path))
+        , owner(other.owner)
+        , header(other.header)
+        , size(other.size) {
+        other.header = nullptr;
+        other.owner = false;
+    }
+
+    ShmRing(const ShmRing&) = delete;
+    ShmRing& operator=(const ShmRing&) = delete;
+
+    ~ShmRing() {
+        if (header != nullptr) {
+            munmap(header, size);
+        }
+        if (owner) {
+            shm_unlink(path.c_str());
+        }
+    }
+
+    uint32_t getBlockSize() const {
+        return header->blockSize;
+    }
+
+    State getState() const {
+        return (State) header->state.load(std::memory_order_acquire);
+    }
+
+    uint32_t getEvents() const {
+        /// Returns counter of ring changes to be passed to wait after checking the ring.
+        return header->events.load();
+    }
+
+    void wait(uint32_t events, Poco::Timespan timeout) {
+        /// Sleeps until the ring changes after the events counter was read, or until timeout.
+        header->waiters.fetch_add(1);
+        if (header->events.load() == events) {
+#ifdef __linux__
+            struct timespec ts;
+            ts.tv_sec = (time_t) timeout.totalSeconds();
+            ts.tv_nsec = (long) timeout.useconds() * 1000 + (long) timeout.milliseconds() * 1000000;
+            syscall(SYS_futex, reinterpret_cast<uint32_t*>(&header->events), FUTEX_WAIT, events, &ts, nullptr, 0);
+#else
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+#endif
+        }
+        header->waiters.fetch_sub(1);
+    }
+
+    // producer side
+
+    bool attach() {
+        /// Takes the ring for a transfer if no other client uses it.
+        int32_t expected = 0;
+        if (!header->clientPid.compare_exchange_strong(expected, (int32_t) getpid())) {
+            return false;
+        }
+        // the state is IDLE until the pid is cleared by release
+        setState(ATTACHED);
+        return true;
+    }
+
+    bool write(const char* blocks, uint64_t count, Poco::Timespan timeout) {
+        /// Copies blocks into the ring, waiting for the server to free space. Returns false if the server failed
+        /// the transfer, and throws TimeoutException if the server frees no space for timeout.
+        uint64_t capacity = header->capacity;
+        uint64_t head = header->head.load(std::memory_order_relaxed);
+        uint64_t tail = header->tail.load(std::memory_order_acquire);
+        Poco::Timestamp progress;
+        while (count > 0) {
+            auto events = getEvents();
+            if (getState() == FAILED) {
+                return false;
+            }
+            if (tail != header->tail.load(std::memory_order_acquire)) {
+                tail = header->tail.load(std::memory_order_acquire);
+                progress.update();
+            }
+            uint64_t free = capacity - (head - tail);
+            if (free == 0) {
+                if (progress.isElapsed(timeout.totalMicroseconds())) {
+                    throw Poco::TimeoutException(Poco::format("server consumed no blocks for %Ld ms", timeout.totalMilliseconds()));
+                }
+                wait(events, waitTimeout);
+                continue;
+            }
+            uint64_t n = std::min(std::min(free, count), capacity - head % capacity);
+            std::memcpy(getBlock(head), blocks, n * header->blockSize);
+            head += n;
+            blocks += n * header->blockSize;
+            count -= n;
+            header->head.store(head, std::memory_order_release);
+            notify();
+        }
+        return true;
+    }
+
+    void close() {
+        /// Marks all blocks written, unless the server already failed the transfer.
+        uint32_t expected = ATTACHED;
+        if (header->state.compare_exchange_strong(expected, CLOSED)) {
+            notify();
+        }
+    }
+
+    std::string waitForAnswer(Poco::Timespan timeout) {
+        /// Waits for the server answer and releases the ring for the next client. Throws IOException with
+        /// the answer if the server failed the transfer, and TimeoutException if the server consumes
+        /// no blocks and does not answer for timeout.
+        uint64_t tail = header->tail.load(std::memory_order_acquire);
+        Poco::Timestamp progress;
+        while (true) {
+            auto events = getEvents();
+            auto state = getState();
+            if (state == ANSWERED || state == FAILED) {
+                break;
+            }
+            if (tail != header->tail.load(std::memory_order_acquire)) {
+                tail = header->tail.load(std::memory_order_acquire);
+                progress.update();
+            } else if (progress.isElapsed(timeout.totalMicroseconds())) {
+                throw Poco::TimeoutException(Poco::format("no answer from server for %Ld ms", timeout.totalMilliseconds()));
+            }
+            wait(events, waitTimeout);
+        }
+        bool failed = getState() == FAILED;
+        std::string answer(header->answer, header->answerLength);
+        release();
+        if (failed) {
+            throw Poco::IOException(Poco::format("server failed the transfer: %s", answer));
+        }
+        return answer;
+    }
+
+    // consumer side
+
+    uint64_t available(const char*& blocks) const {
+        /// Returns count of blocks written by the client and stored contiguously from blocks.
+        uint64_t tail = header->tail.load(std::memory_order_relaxed);
+        uint64_t head = header->head.load(std::memory_order_acquire);
+        blocks = getBlock(tail);
+        return std::min(head - tail, header->capacity - tail % header->capacity);
+    }
+
+    void consume(uint64_t count) {
+        header->tail.store(header->tail.load(std::memory_order_relaxed) + count, std::memory_order_release);
+        notify();
+    }
+
+    void answer(const std::string& text) {
+        /// Puts the answer for the client that closed the ring.
+        putAnswer(text);
+        setState(ANSWERED);
+    }
+
+    void fail(const std::string& text) {
+        /// Puts the error for the client, which stops writing, if the transfer is not finished yet.
+        putAnswer(text);
+        uint32_t state = header->state.load();
+        while ((state == ATTACHED || state == CLOSED) && !header->state.compare_exchange_weak(state, FAILED)) {
+        }
+        notify();
+    }
+
+    bool releaseIfClientDied() {
+        /// Releases the ring taken by a client which no longer exists. Returns whether the ring was released.
+        int32_t pid = header->clientPid.load();
+        if (pid == 0 || isProcessAlive(pid)) {
+            return false;
+        }
+        release();
+        return true;
+    }
+
+private:
+    static constexpr uint32_t magic = 0x48414d53;
+    static constexpr size_t cacheLineSize = 64;
+    const Poco::Timespan waitTimeout = Poco::Timespan(0, 100000);
+
+    struct Header {
+        uint32_t magic = 0;
+        uint32_t blockSize = 0;
+        uint64_t capacity = 0;
+        std::atomic<int32_t> serverPid{0};
+        alignas(cacheLineSize) std::atomic<uint64_t> head{0};
+        alignas(cacheLineSize) std::atomic<uint64_t> tail{0};
+        alignas(cacheLineSize) std::atomic<uint32_t> state{IDLE};
+        std::atomic<int32_t> clientPid{0};
+        std::atomic<uint32_t> events{0};
+        std::atomic<uint32_t> waiters{0};
+        uint32_t answerLength = 0;
+        char answer[1024];
+    };
+
+    static_assert(std::atomic<uint64_t>::is_always_lock_free && std::atomic<uint32_t>::is_always_lock_free
+        && std::atomic<int32_t>::is_always_lock_free,
+        "ring atomics must be lock-free to be shared between processes");
+
+    ShmRing(std::string path, bool owner): path(std::move(path)), owner(owner) {
+    }
+
+    static std::string getPath(const std::string& name) {
+        return name.empty() || name[0] != '/' ? "/" + name : name;
+    }
+
+    static int32_t getServerPid(const std::string& name) {
+        /// Returns pid of the server of existing segment, or 0 if the segment is not a ring.
+        try {
+            return open(name).header->serverPid.load();
+        } catch (Poco::Exception&) {
+            return 0;
+        }
+    }
+
+    static bool isProcessAlive(int32_t pid) {
+        return kill(pid, 0) == 0 || errno != ESRCH;
+    }
+
+    static void throwError(const std::string& action, const std::string& path) {
+        throw Poco::SystemException(Poco::format("%s %s: %s", action, path, std::string(strerror(errno))));
+    }
+
+    void map(int fd, size_t mapSize, bool resize) {
+        if (resize && ftruncate(fd, (off_t) mapSize) != 0) {
+            int error = errno;
+            ::close(fd);
+            errno = error;
+            throwError("failed to resize shared memory", path);
+        }
+        void* mapped = mmap(nullptr, mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        int error = errno;
+        ::close(fd);
+        if (mapped == MAP_FAILED) {
+            errno = error;
+            throwError("failed to map shared memory", path);
+        }
+        header = static_cast<Header*>(mapped);
+        size = mapSize;
+    }
+
+    char* getBlock(uint64_t index) const {
+        return reinterpret_cast<char*>(header + 1) + (index % header->capacity) * header->blockSize;
+    }
+
+    void putAnswer(const std::string& text) {
+        header->answerLength = (uint32_t) std::min(text.length(), sizeof(header->answer));
+        std::memcpy(header->answer, text.data(), header->answerLength);
+    }
+
+    void release() {
+        /// Empties the ring when the client no longer writes and lets the next client take it.
+        header->head.store(0, std::memory_order_relaxed);
+        header->tail.store(0, std::memory_order_relaxed);
+        setState(IDLE);
+        header->clientPid.store(0);
+    }
+
+    void setState(State state) {
+        header->state.store(state, std::memory_order_release);
+        notify();
+    }
+
+    void notify() {
+        header->events.fetch_add(1);
+        if (header->waiters.load() > 0) {
+#ifdef __linux__
+            syscall(SYS_futex, reinterpret_cast<uint32_t*>(&header->events), FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+#endif
+        }
+    }
+
+    std::string path;
+    bool owner;
+    Header* header = nullptr;
+    size_t size = 0;
+};
@@ -5,13 +5,28 @@
 #include <Poco/Logger.h>
 #include <Poco/ConsoleChannel.h>
 #include <Poco/Bugcheck.h>
+#include <Poco/Timestamp.h>
 #include <algorithm>
+#include <atomic>
+#include <deque>
+#include <exception>
+#include <functional>
 #include <iomanip>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <random>
 #include <string>
+#include <thread>
+#include <utility>
 #include <vector>
 #include <unordered_map>
+#include <sys/wait.h>
+#include <unistd.h>
 #include "hamming_code.h"
+#include "block_format.h"
+#include "adaptive_rate.h"
+#include "shm_ring.h"
 
 
 Poco::Logger& logger = Poco::Logger::get("test_hamming_code");
@@ -163,6 +178,406 @@ void stressTest() {
     logger.information("passed stress test");
 }
 
+class WorkStealingPool
+    /// Runs submitted tasks on several threads. Every thread takes tasks from the back of its own queue
+    /// and steals from the front of the other queues when its own is empty.
+{
+public:
+    explicit WorkStealingPool(size_t threadsCount): queues(threadsCount) {
+    }
+
+    void submit(std::function<void()> task) {
+        queues[lastQueue++ % queues.size()].tasks.push_back(std::move(task));
+    }
+
+    void run() {
+        /// Runs all submitted tasks and rethrows the first exception thrown by them.
+        std::vector<std::thread> threads;
+        for (size_t i = 0; i < queues.size(); i++) {
+            threads.emplace_back([this, i] {
+                std::function<void()> task;
+                while (takeTask(i, task) && !failed) {
+                    try {
+                        task();
+                    } catch (...) {
+                        std::lock_guard<std::mutex> lock(errorMutex);
+                        if (!failed) {
+                            error = std::current_exception();
+                            failed = true;
+                        }
+                    }
+                }
+            });
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+
+private:
+    struct Queue {
+        std::mutex mutex;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    bool takeTask(size_t queueIndex, std::function<void()>& task) {
+        {
+            auto& own = queues[queueIndex];
+            std::lock_guard<std::mutex> lock(own.mutex);
+            if (!own.tasks.empty()) {
+                task = std::move(own.tasks.back());
+                own.tasks.pop_back();
+                return true;
+            }
+        }
+        for (size_t i = 1; i < queues.size(); i++) {
+            auto& victim = queues[(queueIndex + i) % queues.size()];
+            std::lock_guard<std::mutex> lock(victim.mutex);
+            if (!victim.tasks.empty()) {
+                task = std::move(victim.tasks.front());
+                victim.tasks.pop_front();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    std::vector<Queue> queues;
+    size_t lastQueue = 0;
+    std::mutex errorMutex;
+    std::exception_ptr error;
+    std::atomic<bool> failed{false};
+};
+
+std::atomic<size_t> exhaustivePatternsCount{0};
+
+template <int wordSize>
+void checkErrorPatterns(const HammingCode<wordSize>& h, const std::bitset<wordSize>& message, int firstError) {
+    /// Checks blocks with no errors (if firstError is -1), or with error at firstError and optionally
+    /// one more error after it, comparing decode paths: HammingCode::decode, RuntimeHammingCode used by
+    /// the server and the batch path of block_format.h used by hamming_codec.
+    using Code = HammingCode<wordSize>;
+    constexpr int blockSize = Code::getBlockSize();
+    static const RuntimeHammingCodeImpl<wordSize> runtimeCode;
+    auto word = message;
+    auto encoded = h.encode(word);
+
+    std::vector<std::bitset<blockSize>> blocks;
+    if (firstError < 0) {
+        blocks.push_back(encoded);
+    } else {
+        blocks.push_back(encoded);
+        blocks.back().flip(firstError);
+        for (int secondError = firstError + 1; secondError < blockSize; secondError++) {
+            blocks.push_back(blocks.front());
+            blocks.back().flip(secondError);
+        }
+    }
+
+    std::string batch((size_t) blocks.size() * blockSize, ' ');
+    for (size_t i = 0; i < blocks.size(); i++) {
+        formatBlock<Code>(blocks[i], &batch[i * blockSize]);
+    }
+    std::string batchDecoded((blocks.size() * wordSize + 7) / 8, 0);
+    for (size_t i = 0; i < blocks.size(); i++) {
+        auto decodingResult = h.decode(parseBlock<Code>(&batch[i * blockSize]));
+        writeWord<Code>(decodingResult.first, i, &batchDecoded[0], batchDecoded.size());
+    }
+
+    for (size_t i = 0; i < blocks.size(); i++) {
+        int expectedErrors = firstError < 0 ? 0 : (i == 0 ? 1 : 2);
+        auto errorText = Poco::format("word size %d, message %s, errors at %d and %z",
+            wordSize, message.to_string(), firstError, firstError + i);
+
+        auto decodingResult = h.decode(blocks[i]);
+        poco_assert_msg(decodingResult.second == expectedErrors, (errorText + Poco::format(", detected %d", decodingResult.second)).data());
+        poco_assert_msg(expectedErrors == 2 || decodingResult.first == message, (errorText + ", scalar decoded wrong word").data());
+
+        std::string runtimeDecoded;
+        int runtimeErrors = runtimeCode.decode(&batch[i * blockSize], runtimeDecoded);
+        poco_assert_msg(runtimeErrors == decodingResult.second, (errorText + ", runtime path differs in errors").data());
+        for (int bit = 0; bit < wordSize; bit++) {
+            poco_assert_msg((runtimeDecoded[bit] == '1') == decodingResult.first[bit], (errorText + ", runtime path differs in word").data());
+            size_t batchBit = i * wordSize + bit;
+            bool batchValue = (batchDecoded[batchBit / 8] >> (batchBit % 8)) & 1;
+            poco_assert_msg(batchValue == decodingResult.first[bit], (errorText + ", batch path differs in word").data());
+        }
+    }
+    exhaustivePatternsCount += blocks.size();
+}
+
+template <int wordSize>
+void submitExhaustiveTest(WorkStealingPool& pool) {
+    /// Submits tasks checking all error patterns of one and two bits for several messages,
+    /// or for all messages of small word sizes.
+    auto h = std::make_shared<HammingCode<wordSize>>();
+    std::vector<std::bitset<wordSize>> messages;
+    if (wordSize <= 8) {
+        for (unsigned long long m = 0; m < (1ull << wordSize); m++) {
+            messages.emplace_back(m);
+        }
+    } else {
+        std::mt19937 random(wordSize);
+        messages.emplace_back();
+        messages.emplace_back(std::bitset<wordSize>().flip());
+        for (int i = 0; i < (wordSize <= 100 ? 6 : 2); i++) {
+            std::bitset<wordSize> message;
+            for (int j = 0; j < wordSize; j++) {
+                message[j] = random() % 2;
+            }
+            messages.push_back(message);
+        }
+    }
+    for (const auto& message : messages) {
+        for (int firstError = -1; firstError < h->getBlockSize(); firstError++) {
+            pool.submit([h, message, firstError] {
+                checkErrorPatterns<wordSize>(*h, message, firstError);
+            });
+        }
+    }
+}
+
+template <int... wordSizes>
+void submitExhaustiveTests(WorkStealingPool& pool, std::integer_sequence<int, wordSizes...>) {
+    (submitExhaustiveTest<wordSizes>(pool), ...);
+}
+
+void exhaustiveTest() {
+    Poco::Timestamp started;
+    size_t threadsCount = std::max(1u, std::thread::hardware_concurrency());
+    WorkStealingPool pool(threadsCount);
+    submitExhaustiveTests(pool, std::make_integer_sequence<int, 41>());
+    submitExhaustiveTests(pool, std::integer_sequence<int, 57, 100, 120, 500>());
+    pool.run();
+    logger.information("passed exhaustive test: %z error patterns on %z threads in %Ld ms",
+        exhaustivePatternsCount.load(), threadsCount, started.elapsed() / 1000);
+}
+
+void roundTripTest() {
+    /// Encodes messages of many sizes into words of the client layout and decodes them back
+    /// with the helpers of hamming_codec, including sizes filling whole words.
+    using Code = FixedHammingCode;
+    FixedHammingCode h;
+    std::mt19937 random(1);
+    for (size_t messageSize = 0; messageSize <= 3 * wordSize + 1; messageSize++) {
+        std::string message(messageSize, 0);
+        for (auto& c : message) {
+            c = (char) random();
+        }
+        size_t wordsCount = getEncodedWordsCount<Code>(messageSize);
+        std::vector<std::bitset<Code::getBlockSize()>> blocks;
+        for (size_t i = 0; i < wordsCount; i++) {
+            auto word = readWord<Code>(message.data(), messageSize, i);
+            blocks.push_back(h.encode(word));
+        }
+
+        size_t tailSize = h.decode(blocks.back()).first.to_ulong();
+        std::string decoded(getDecodedSize<Code>(wordsCount, tailSize), 0);
+        for (size_t i = 0; i < wordsCount; i++) {
+            writeWord<Code>(h.decode(blocks[i]).first, i, &decoded[0], decoded.size());
+        }
+        poco_assert_msg(decoded == message, Poco::format("message of %z bytes decoded into %z bytes",
+            messageSize, decoded.size()).data());
+    }
+    logger.information("passed round trip test");
+}
+
+void rateControllerTest() {
+    const auto& codes = getRateCodes();
+    for (auto expected : std::vector<std::pair<double, int>>{{0, 120}, {1e-2, 26}, {1e-1, 4}}) {
+        RateController controller(getFixedCodeIndex());
+        const uint64_t bits = 1000000;
+        controller.addFeedback(bits, (uint64_t) (expected.first * bits), 0, 0);
+        int chosen = codes[controller.getCodeIndex()]->getWordSize();
+        poco_assert_msg(chosen == expected.second, Poco::format("bit error rate %f: chose word size %d, expected %d",
+            expected.first, chosen, expected.second).data());
+    }
+
+    for (size_t i = 0; i < codes.size(); i++) {
+        poco_assert(parseRateMarker(makeRateMarker(i).data()) == i);
+    }
+    for (const std::string& marker : std::vector<std::string>{"R6", "R9", "R/", "R:", "r0", "X1", std::string(1, rateMarker) + '\0'}) {
+        bool rejected = false;
+        try {
+            parseRateMarker(marker.data());
+        } catch (const Poco::Exception&) {
+            rejected = true;
+        }
+        poco_assert_msg(rejected, Poco::format("accepted bad rate marker %s", marker).data());
+    }
+    logger.information("passed rate controller test");
+}
+
+class TestBlockDecoder
+    /// Decoder of rate streams with the interface of the server BlockDecoder.
+{
+public:
+    void setCode(size_t codeIndex) {
+        code = getRateCodes()[codeIndex].get();
+    }
+
+    int getBlockSize() const {
+        return code->getBlockSize();
+    }
+
+    void decode(const char* data, size_t blocksCount, std::string& decodedMessage) {
+        for (size_t i = 0; i < blocksCount; i++) {
+            code->decode(data + i * code->getBlockSize(), decodedMessage);
+        }
+    }
+
+private:
+    const RuntimeHammingCode* code = getRateCodes()[getFixedCodeIndex()].get();
+};
+
+void rateStreamTest() {
+    /// Decodes a stream switching codes between blocks, received in pieces cut at every position,
+    /// markers included, as the server receives it from a socket.
+    const auto& codes = getRateCodes();
+    std::string stream, message;
+    std::mt19937 random(1);
+    for (size_t codeIndex : {getFixedCodeIndex(), (size_t) 0, (size_t) 5, (size_t) 2, (size_t) 2, (size_t) 1, (size_t) 4}) {
+        const auto& code = *codes[codeIndex];
+        stream += makeRateMarker(codeIndex);
+        for (int block = 0; block < 3; block++) {
+            std::string word;
+            for (int i = 0; i < code.getWordSize(); i++) {
+                word.push_back(random() % 2 ? '1' : '0');
+            }
+            message += word;
+            stream.resize(stream.length() + code.getBlockSize());
+            code.encode(word.data(), &stream[stream.length() - code.getBlockSize()]);
+        }
+    }
+
+    for (size_t pieceSize = 1; pieceSize <= 300; pieceSize += pieceSize < 10 ? 1 : 37) {
+        TestBlockDecoder decoder;
+        std::string buffer, decodedMessage;
+        for (size_t pos = 0; pos < stream.length(); pos += pieceSize) {
+            buffer += stream.substr(pos, pieceSize);
+            buffer.erase(0, decodeRateStream(buffer.data(), buffer.length(), decoder, decodedMessage));
+        }
+        poco_assert_msg(buffer.empty(), Poco::format("pieces of %z chars: %z chars left undecoded", pieceSize, buffer.length()).data());
+        poco_assert_msg(decodedMessage == message, Poco::format("pieces of %z chars: decoded wrong message", pieceSize).data());
+    }
+    logger.information("passed rate stream test");
+}
+
+template <class Producer>
+int runShmProducer(const std::string& name, Producer producer) {
+    /// Runs producer(ring) in a forked process attached to the ring, returning its pid.
+    /// The process exit code is the code returned by producer, or 100 if it throws.
+    pid_t pid = fork();
+    poco_assert(pid >= 0);
+    if (pid == 0) {
+        int code = 100;
+        try {
+            auto ring = ShmRing::open(name);
+            code = ring.attach() ? producer(ring) : 101;
+        } catch (...) {
+        }
+        _exit(code);
+    }
+    return pid;
+}
+
+int waitShmProducer(int pid) {
+    int status = 0;
+    waitpid(pid, &status, 0);
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+void shmRingTest() {
+    /// Passes blocks from a forked client through a ring much smaller than the message, so that it wraps around
+    /// at different offsets, then checks the failed transfer and the release of the ring taken by a dead client.
+    const std::string name = Poco::format("test_hamming_code_%d", (int) getpid());
+    const uint32_t blockSize = FixedHammingCode::getBlockSize();
+    const uint64_t capacity = 7;
+    const size_t blocksCount = 1000;
+    const Poco::Timespan timeout(5, 0);
+    std::string message(blocksCount * blockSize, 0);
+    for (size_t i = 0; i < message.size(); i++) {
+        message[i] = (char) (i % 251);
+    }
+    auto ring = ShmRing::create(name, blockSize, capacity);
+
+    int pid = runShmProducer(name, [&](ShmRing& client) {
+        for (size_t written = 0, chunk = 1; written < blocksCount; written += chunk, chunk = chunk % 5 + 1) {
+            chunk = std::min(chunk, blocksCount - written);
+            if (!client.write(&message[written * blockSize], chunk, timeout)) {
+                return 1;
+            }
+        }
+        client.close();
+        return client.waitForAnswer(timeout) == "ok" ? 0 : 2;
+    });
+    std::string received;
+    Poco::Timestamp started;
+    while (!started.isElapsed(timeout.totalMicroseconds())) {
+        auto events = ring.getEvents();
+        auto state = ring.getState();
+        const char* blocks;
+        uint64_t count = ring.available(blocks);
+        poco_assert(count <= capacity);
+        if (count > 0) {
+            received.append(blocks, count * blockSize);
+            ring.consume(count);
+        } else if (state == ShmRing::CLOSED) {
+            break;
+        } else {
+            ring.wait(events, Poco::Timespan(0, 100000));
+        }
+    }
+    ring.answer(received == message ? "ok" : "bad");
+    int code = waitShmProducer(pid);
+    poco_assert_msg(received == message, Poco::format("received %z of %z bytes, or different bytes", received.size(), message.size()).data());
+    poco_assert_msg(code == 0, Poco::format("client of full transfer exited with %d", code).data());
+
+    pid = runShmProducer(name, [&](ShmRing& client) {
+        if (client.write(message.data(), blocksCount, timeout)) {
+            return 1;
+        }
+        try {
+            client.waitForAnswer(timeout);
+        } catch (Poco::IOException&) {
+            return 0;
+        }
+        return 2;
+    });
+    uint64_t consumed = 0;
+    while (consumed < 3 * capacity) {
+        auto events = ring.getEvents();
+        const char* blocks;
+        uint64_t count = ring.available(blocks);
+        if (count > 0) {
+            ring.consume(count);
+            consumed += count;
+        } else {
+            ring.wait(events, Poco::Timespan(0, 100000));
+        }
+    }
+    ring.fail("test failure");
+    code = waitShmProducer(pid);
+    poco_assert_msg(code == 0, Poco::format("client of failed transfer exited with %d", code).data());
+    poco_assert_msg(ring.getState() == ShmRing::IDLE, "failed transfer not released by client");
+
+    pid = runShmProducer(name, [&](ShmRing& client) {
+        client.write(message.data(), 3, timeout);
+        return 0;
+    });
+    code = waitShmProducer(pid);
+    poco_assert_msg(code == 0, Poco::format("dying client exited with %d", code).data());
+    poco_assert_msg(ring.getState() == ShmRing::ATTACHED, "ring not attached by dying client");
+    poco_assert_msg(ring.releaseIfClientDied(), "ring of dead client not released");
+    const char* blocks;
+    poco_assert_msg(ring.getState() == ShmRing::IDLE && ring.available(blocks) == 0, "released ring not empty");
+    poco_assert_msg(ring.attach() && !ring.releaseIfClientDied(), "ring of live client released");
+    logger.information("passed shared memory ring test");
+}
+
 template <int wordSize>
 void getManyErrorsDetectionRatio() {
     HammingCode<wordSize> h;
@@ -203,6 +618,11 @@ int main() {
     logger.setChannel(new Poco::ConsoleChannel(std::cout));
     test1();
     stressTest();
+    exhaustiveTest();
+    roundTripTest();
+    rateControllerTest();
+    rateStreamTest();
+    shmRingTest();
     getManyErrorsDetectionRatio<4>();
     getManyErrorsDetectionRatio<5>();
     getManyErrorsDetectionRatio<25>();